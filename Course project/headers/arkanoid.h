@@ -2,7 +2,10 @@
 #define ARKANOID_ARKANOID_H
 
 #include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <cmath>
 #include <utility>
+#include <vector>
 #include <array_2d.h>
 #include <image.h>
 #include <cstdint>
@@ -74,15 +77,33 @@ public:
     static constexpr size_t BLOCK_WIDTH = 100;
     static constexpr size_t BLOCK_HEIGHT = 60;
 
+    // with several paddles they split PADDLE_WIDTH and start spread evenly
+    // along the bottom edge, paddle 0 leftmost
     Game(size_t board_width,
-         size_t board_height):
+         size_t board_height,
+         size_t paddles = 1):
         _board_width(board_width),
         _board_height(board_height),
         _blocks(board_width / BLOCK_WIDTH, board_height / 2 / BLOCK_HEIGHT),
         _ball(*new MovingObject(cv::Point2f(_board_width / 2, _board_height / 2 + 40), cv::Point2f(0.0f, BALL_SPEED), cv::Scalar(255, 255, 255))),
-        _paddle(board_width / 2.0f - PADDLE_WIDTH / 2, board_height - PADDLE_HEIGHT, PADDLE_WIDTH, PADDLE_HEIGHT),
-        _score(0)
+        _score(0),
+        _max_prediction_ns(100000000),
+        _predictions_checked(0),
+        _prediction_error(0.0),
+        _hold_error(0.0)
     {
+        float width = PADDLE_WIDTH / paddles;
+        for (size_t i = 0; i < paddles; ++i) {
+            float center = board_width * (i + 0.5f) / paddles;
+
+            Paddle paddle;
+            paddle.rect = { center - width / 2, board_height - PADDLE_HEIGHT, width, PADDLE_HEIGHT };
+            paddle.target_x = center;
+            paddle.target_velocity = 0.0f;
+            paddle.target_ns = 0;
+            _paddles.push_back(paddle);
+        }
+
         reset();
     }
 
@@ -103,14 +124,82 @@ public:
             handleCollisions();
     }
 
+    size_t paddles() const
+    {
+        return _paddles.size();
+    }
+
     void setPaddlePos(size_t pos)
     {
-        _paddle.x = pos - _paddle.width / 2;
+        cv::Rect_<float>& rect = _paddles[0].rect;
+        rect.x = pos - rect.width / 2;
+    }
+
+    // marker x seen at `sample_ns` (Timer::monotonicNanos), moving at
+    // `velocity_x` px/s; extrapolatePaddle() then moves the paddle
+    void setPaddleTarget(float x,
+                         float velocity_x,
+                         long long sample_ns)
+    {
+        setPaddleTarget(0, x, velocity_x, sample_ns);
+    }
+
+    void setPaddleTarget(size_t idx,
+                         float x,
+                         float velocity_x,
+                         long long sample_ns)
+    {
+        Paddle& paddle = _paddles[idx];
+
+        // how well the previous sample predicted this one, and how far off
+        // simply holding it would have been
+        if (paddle.target_ns != 0 && sample_ns > paddle.target_ns) {
+            _prediction_error += std::abs(predictTarget(paddle, sample_ns) - x);
+            _hold_error += std::abs(paddle.target_x - x);
+            ++_predictions_checked;
+        }
+
+        paddle.target_x = x;
+        paddle.target_velocity = velocity_x;
+        paddle.target_ns = sample_ns;
+    }
+
+    // places the paddles where their markers should be at `present_ns`,
+    // looking at most max_prediction ahead of the last sample; returns how
+    // far ahead it predicted the first paddle, in ns
+    long long extrapolatePaddle(long long present_ns)
+    {
+        for (Paddle& paddle: _paddles) {
+            if (paddle.target_ns != 0) {
+                paddle.rect.x = predictTarget(paddle, present_ns) - paddle.rect.width / 2;
+            }
+        }
+
+        const Paddle& first = _paddles[0];
+        return first.target_ns != 0 ? predictionHorizon(first, present_ns) : 0;
+    }
+
+    void setMaxPrediction(double seconds)
+    {
+        _max_prediction_ns = (long long)(seconds * 1e9);
+    }
+
+    // mean distance between each marker sample and where the paddle was
+    // predicted to be at that time; and without prediction
+    double meanPredictionError() const
+    {
+        return _predictions_checked ? _prediction_error / _predictions_checked : 0.0;
+    }
+
+    double meanHoldError() const
+    {
+        return _predictions_checked ? _hold_error / _predictions_checked : 0.0;
     }
 
     void drawOnto(Image& img)
     {
-        Image board_img(img.size(), img.type(), cv::Scalar(0, 0, 0));
+        _board_img.create(img.size(), img.type());
+        _board_img.setTo(cv::Scalar(0, 0, 0));
         cv::Rect board_rect { 0, 0, (int)_board_width, (int)_board_height };
 
         for (size_t y = 0; y < _blocks.height; y+=2) {
@@ -120,14 +209,16 @@ public:
                 }
 
                 cv::Scalar color = cv::Scalar(0.0f, 255.0f, 0.0f);
-                cv::rectangle(board_img, rectForBlock(x, y), color, -1);
+                cv::rectangle(_board_img, rectForBlock(x, y), color, -1);
             }
         }
 
         cv::circle(img, _ball.position, BALL_RADIUS, _ball.color, -1);
 
-        cv::rectangle(img, _paddle, cv::Scalar(255, 255, 255), -1);
-        img += board_img;
+        for (const Paddle& paddle: _paddles) {
+            cv::rectangle(img, paddle.rect, cv::Scalar(255, 255, 255), -1);
+        }
+        img += _board_img;
     };
 
     bool isGameOver() const
@@ -171,8 +262,11 @@ private:
             ball.position.y = 0.0f;
         }
 
-        if (ballHitsRect(ball.position, (float)BALL_RADIUS, _paddle)) {
-            ball.velocity = velocityFromBallPos(ball.position.x);
+        for (const Paddle& paddle: _paddles) {
+            if (ballHitsRect(ball.position, (float)BALL_RADIUS, paddle.rect)) {
+                ball.velocity = velocityFromBallPos(ball.position.x, paddle.rect);
+                break;
+            }
         }
 
         for (size_t y = 0; y < _blocks.height; ++y) {
@@ -195,9 +289,30 @@ private:
         }
     };
 
-    cv::Point2f velocityFromBallPos(float ball_x)
+    struct Paddle
+    {
+        cv::Rect_<float> rect;
+        float target_x;
+        float target_velocity;
+        long long target_ns;
+    };
+
+    long long predictionHorizon(const Paddle& paddle,
+                                long long at_ns) const
+    {
+        return std::max(0LL, std::min(at_ns - paddle.target_ns, _max_prediction_ns));
+    }
+
+    float predictTarget(const Paddle& paddle,
+                        long long at_ns) const
     {
-        float relative_x = (ball_x - _paddle.x) / _paddle.width;
+        return paddle.target_x + paddle.target_velocity * (float)(predictionHorizon(paddle, at_ns) / 1e9);
+    }
+
+    cv::Point2f velocityFromBallPos(float ball_x,
+                                    const cv::Rect_<float>& paddle)
+    {
+        float relative_x = (ball_x - paddle.x) / paddle.width;
         float angle = (relative_x - 0.5f) * ((float)CV_PI * 0.5f);
         return { std::sin(angle) * BALL_SPEED,
                  -std::cos(angle) * BALL_SPEED };
@@ -218,8 +333,15 @@ private:
     size_t _board_height;
     Array2D<uint8_t> _blocks;
     MovingObject _ball;
-    cv::Rect_<float> _paddle;
+    std::vector<Paddle> _paddles;
     int _score;
+    Image _board_img;
+
+    long long _max_prediction_ns;
+
+    unsigned long long _predictions_checked;
+    double _prediction_error;
+    double _hold_error;
 };
 
 #endif
@@ -0,0 +1,326 @@
+#ifndef _ARKANOID_CALIBRATION_H_
+#define _ARKANOID_CALIBRATION_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include <image.h>
+#include "motion_detector.h"
+
+// the detector settings calibration tunes for a room; persisted as YAML
+struct Calibration
+{
+    cv::Scalar marker_colour;
+    int marker_colour_tolerance;
+    int motion_threshold;
+    int min_poly_area;
+
+    static Calibration from(const MotionDetector::Settings& settings) {
+        return { settings.marker_colour, settings.marker_colour_tolerance,
+                 settings.motion_threshold, settings.min_poly_area };
+    }
+
+    void applyTo(MotionDetector::Settings& settings) const {
+        settings.marker_colour = marker_colour;
+        settings.marker_colour_tolerance = marker_colour_tolerance;
+        settings.motion_threshold = (uint8_t)std::max(0, std::min(motion_threshold, 255));
+        settings.min_poly_area = min_poly_area;
+    }
+
+    bool save(const std::string& path) const {
+        cv::FileStorage fs(path, cv::FileStorage::WRITE);
+        if (!fs.isOpened()) {
+            return false;
+        }
+
+        fs << "marker_colour" << marker_colour
+           << "marker_colour_tolerance" << marker_colour_tolerance
+           << "motion_threshold" << motion_threshold
+           << "min_poly_area" << min_poly_area;
+        return true;
+    }
+
+    // leaves *this alone unless the file has every field
+    bool load(const std::string& path) {
+        cv::FileStorage fs(path, cv::FileStorage::READ);
+        if (!fs.isOpened()) {
+            return false;
+        }
+
+        for (const char* key: { "marker_colour", "marker_colour_tolerance",
+                                "motion_threshold", "min_poly_area" }) {
+            if (fs[key].empty()) {
+                return false;
+            }
+        }
+
+        fs["marker_colour"] >> marker_colour;
+        fs["marker_colour_tolerance"] >> marker_colour_tolerance;
+        fs["motion_threshold"] >> motion_threshold;
+        fs["min_poly_area"] >> min_poly_area;
+        return true;
+    }
+};
+
+/*
+ * Startup calibration, fed camera frames one at a time.
+ *
+ * Marker phase: the player holds the marker in a box in the middle of the
+ * frame. The key colour is the per-channel median of the middle of the box;
+ * the tolerance covers most of the marker but lets through at most
+ * MAX_BACKGROUND_SHARE of the pixels outside the box.
+ *
+ * Noise phase: the marker is out of view and nothing moves. Each pair of
+ * frames goes through the real detector at every candidate motion threshold,
+ * which gives a noise-floor histogram of blob counts and sizes. The lowest
+ * threshold that keeps the noise within MAX_NOISE_BLOBS blobs in nearly all
+ * frames wins, and min_poly_area is set above the largest noise blob left.
+ *
+ * Each phase starts with WARMUP_FRAMES the player gets to follow the
+ * instructions in.
+ */
+class Calibrator
+{
+public:
+    enum class Phase
+    {
+        Marker,
+        Noise,
+        Done,
+    };
+
+    static constexpr int WARMUP_FRAMES = 90;
+    static constexpr int MARKER_FRAMES = 45;
+    static constexpr int NOISE_FRAMES = 90;
+
+    static constexpr int SAMPLE_EVERY = 5;          // marker frames between pixel samples
+    static constexpr int SAMPLE_STEP = 8;           // pixels between samples outside the box
+    static constexpr double MAX_BACKGROUND_SHARE = 0.01;
+    static constexpr size_t MAX_NOISE_BLOBS = 2;
+    static constexpr double MAX_NOISY_FRAMES = 0.05;
+
+    Calibrator(size_t width,
+               size_t height,
+               const MotionDetector::Settings& settings):
+        _detector(width, height),
+        _phase(Phase::Marker),
+        _frames(0),
+        _result(Calibration::from(settings))
+    {
+        _detector.settings = settings;
+        _detector.settings.mode = DetectionMode::FrameDifference;
+        _detector.settings.connected_components = true;
+        _detector.settings.skip_static_tiles = false;
+        _detector.settings.min_poly_area = 0;
+
+        for (int threshold = 20; threshold <= 240; threshold += 20) {
+            _noise.push_back({ threshold, 0, 0.0 });
+        }
+    }
+
+    Phase phase() const {
+        return _phase;
+    }
+
+    const char* instructions() const {
+        switch (_phase) {
+        case Phase::Marker:
+            return "Hold the marker inside the box";
+        case Phase::Noise:
+            return "Take the marker out of view and keep still";
+        default:
+            return "Calibrated";
+        }
+    }
+
+    // share of the current phase done, warm-up included
+    double progress() const {
+        int frames = WARMUP_FRAMES + (_phase == Phase::Marker ? MARKER_FRAMES : NOISE_FRAMES);
+        return _phase == Phase::Done ? 1.0 : std::min(1.0, (double)_frames / frames);
+    }
+
+    // where the marker has to be during the marker phase
+    static cv::Rect markerBox(const cv::Size& frame_size) {
+        int side = std::min(frame_size.width, frame_size.height) / 5;
+        return { (frame_size.width - side) / 2, (frame_size.height - side) / 2, side, side };
+    }
+
+    // `frame` is an 8-bit BGR camera frame, flipped like the detector's
+    void addFrame(const Image& frame) {
+        if (_phase == Phase::Done) {
+            return;
+        }
+
+        int sampled = _frames++ - WARMUP_FRAMES;
+        if (sampled < 0) {
+            return;
+        }
+
+        if (_phase == Phase::Marker) {
+            if (sampled % SAMPLE_EVERY == 0) {
+                sampleMarker(frame);
+            }
+            if (sampled + 1 == MARKER_FRAMES) {
+                finishMarker();
+                _phase = Phase::Noise;
+                _frames = 0;
+            }
+        } else {
+            sampleNoise(frame);
+            if (sampled + 1 == NOISE_FRAMES) {
+                finishNoise();
+                _phase = Phase::Done;
+            }
+        }
+    }
+
+    // the settings' values until the phases that tune them are done
+    const Calibration& result() const {
+        return _result;
+    }
+
+private:
+    // frames with more than MAX_NOISE_BLOBS blobs, and the largest blob in
+    // board pixels, at one motion threshold
+    struct NoiseLevel
+    {
+        int threshold;
+        int noisy_frames;
+        double max_area;
+    };
+
+    void sampleMarker(const Image& frame) {
+        cv::Rect box = markerBox(frame.size());
+        cv::Rect centre(box.x + box.width / 4, box.y + box.height / 4, box.width / 2, box.height / 2);
+
+        for (int y = centre.y; y < centre.y + centre.height; y += 2) {
+            const uint8_t* row = frame.ptr<uint8_t>(y);
+            for (int x = centre.x; x < centre.x + centre.width; x += 2) {
+                _marker_samples.push_back({ row[3 * x], row[3 * x + 1], row[3 * x + 2] });
+            }
+        }
+
+        for (int y = SAMPLE_STEP / 2; y < frame.rows; y += SAMPLE_STEP) {
+            const uint8_t* row = frame.ptr<uint8_t>(y);
+            for (int x = SAMPLE_STEP / 2; x < frame.cols; x += SAMPLE_STEP) {
+                if (!box.contains({ x, y })) {
+                    _background_samples.push_back({ row[3 * x], row[3 * x + 1], row[3 * x + 2] });
+                }
+            }
+        }
+    }
+
+    void finishMarker() {
+        if (_marker_samples.empty()) {
+            return;
+        }
+
+        cv::Vec3b key;
+        std::vector<uint8_t> channel(_marker_samples.size());
+        for (int c = 0; c < 3; ++c) {
+            for (size_t i = 0; i < _marker_samples.size(); ++i) {
+                channel[i] = _marker_samples[i][c];
+            }
+            std::nth_element(channel.begin(), channel.begin() + channel.size() / 2, channel.end());
+            key[c] = channel[channel.size() / 2];
+        }
+
+        // the marker's spread plus a margin, unless that lets in too much
+        // of the room
+        const int MARGIN = 8;
+        int tolerance = distancePercentile(_marker_samples, key, 0.9) + MARGIN;
+        if (!_background_samples.empty()) {
+            tolerance = std::min(tolerance, distancePercentile(_background_samples, key,
+                                                               MAX_BACKGROUND_SHARE) - 1);
+        }
+
+        _result.marker_colour = cv::Scalar(key[0], key[1], key[2]);
+        _result.marker_colour_tolerance = std::max(8, std::min(tolerance, 120));
+        _detector.settings.marker_colour = _result.marker_colour;
+        _detector.settings.marker_colour_tolerance = _result.marker_colour_tolerance;
+
+        std::vector<cv::Vec3b>().swap(_marker_samples);
+        std::vector<cv::Vec3b>().swap(_background_samples);
+    }
+
+    void sampleNoise(const Image& frame) {
+        Image curr = _detector.preprocessFrame(frame);
+        if (!_prev.empty()) {
+            for (NoiseLevel& level: _noise) {
+                _detector.settings.motion_threshold = (uint8_t)level.threshold;
+                MotionDetector::Detection detection = _detector.detectMotion(_prev, curr);
+
+                double to_board = (double)_detector.width * _detector.height / detection.mask_size.area();
+                for (const MotionDetector::Blob& blob: detection.blobs) {
+                    level.max_area = std::max(level.max_area, blob.area * to_board);
+                }
+                if (detection.blobs.size() > MAX_NOISE_BLOBS) {
+                    ++level.noisy_frames;
+                }
+            }
+            ++_noise_pairs;
+        }
+        _prev = std::move(curr);
+    }
+
+    void finishNoise() {
+        if (_noise_pairs == 0) {
+            return;
+        }
+
+        const NoiseLevel* chosen = &_noise.back();
+        for (const NoiseLevel& level: _noise) {
+            if (level.noisy_frames <= MAX_NOISY_FRAMES * _noise_pairs) {
+                chosen = &level;
+                break;
+            }
+        }
+
+        _result.motion_threshold = chosen->threshold;
+        _result.min_poly_area = std::max(100, std::min((int)std::ceil(chosen->max_area * 1.5), 5000));
+    }
+
+    // the distance (largest channel difference from `key`) that `share` of
+    // `samples` are at or below
+    static int distancePercentile(const std::vector<cv::Vec3b>& samples,
+                                  const cv::Vec3b& key,
+                                  double share) {
+        size_t histogram[256] = {};
+        for (const cv::Vec3b& p: samples) {
+            int distance = 0;
+            for (int c = 0; c < 3; ++c) {
+                distance = std::max(distance, std::abs((int)p[c] - (int)key[c]));
+            }
+            ++histogram[distance];
+        }
+
+        size_t wanted = (size_t)(share * samples.size());
+        size_t seen = 0;
+        for (int distance = 0; distance < 256; ++distance) {
+            seen += histogram[distance];
+            if (seen > wanted) {
+                return distance;
+            }
+        }
+        return 255;
+    }
+
+    MotionDetector _detector;
+    Phase _phase;
+    int _frames;
+    Calibration _result;
+
+    std::vector<cv::Vec3b> _marker_samples;
+    std::vector<cv::Vec3b> _background_samples;
+
+    Image _prev;
+    std::vector<NoiseLevel> _noise;
+    int _noise_pairs = 0;
+};
+
+#endif
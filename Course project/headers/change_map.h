@@ -0,0 +1,192 @@
+#ifndef _ARKANOID_CHANGE_MAP_H_
+#define _ARKANOID_CHANGE_MAP_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+/*
+ * Block-level change detector: which parts of two consecutive frames differ
+ * enough to be worth running the motion mask over.
+ *
+ * Each tile is compared by the mean absolute difference of a sparse sample
+ * of its pixels (one in SAMPLE_STEP x SAMPLE_STEP), so update() reads about
+ * 1/16th of the frame.
+ *
+ * Changed tiles are grouped when their halos touch; each group becomes one
+ * region to run the motion mask over, so two motions far apart do not make
+ * the whole stretch between them active.
+ */
+class ChangeMap
+{
+public:
+    static constexpr int SAMPLE_STEP = 4;
+
+    ChangeMap(int tile_size = 32,
+              int halo = 1,
+              int threshold = 4):
+        _tile_size(tile_size),
+        _halo(halo),
+        _threshold(threshold),
+        _active(0)
+    {}
+
+    // marks the tiles that changed between `prev` and `curr` (8-bit, same
+    // geometry) and returns one rect per group of them: the group's tiles
+    // plus `halo` tiles on every side, clipped to the frame. The rects do
+    // not overlap; none if nothing changed. Valid until the next update()
+    const std::vector<cv::Rect>& update(const cv::Mat& prev,
+                                        const cv::Mat& curr) {
+        CV_Assert(prev.size() == curr.size() && prev.type() == curr.type());
+
+        _frame_size = curr.size();
+        _tiles = { (curr.cols + _tile_size - 1) / _tile_size,
+                   (curr.rows + _tile_size - 1) / _tile_size };
+        _dirty.assign((size_t)_tiles.area(), 0);
+        _grouped.assign((size_t)_tiles.area(), 0);
+
+        for (int ty = 0; ty < _tiles.height; ++ty) {
+            for (int tx = 0; tx < _tiles.width; ++tx) {
+                if (tileChanged(prev, curr, tx, ty)) {
+                    _dirty[(size_t)(ty * _tiles.width + tx)] = 1;
+                }
+            }
+        }
+
+        _tile_regions.clear();
+        for (int ty = 0; ty < _tiles.height; ++ty) {
+            for (int tx = 0; tx < _tiles.width; ++tx) {
+                if (isDirty(tx, ty) && !_grouped[(size_t)(ty * _tiles.width + tx)]) {
+                    _tile_regions.push_back(groupFrom(tx, ty));
+                }
+            }
+        }
+        mergeOverlapping();
+
+        _active = 0;
+        _regions.clear();
+        for (const cv::Rect& tiles: _tile_regions) {
+            _active += tiles.area();
+
+            cv::Rect roi(tiles.x * _tile_size, tiles.y * _tile_size,
+                         tiles.width * _tile_size, tiles.height * _tile_size);
+            _regions.push_back(roi & cv::Rect(0, 0, _frame_size.width, _frame_size.height));
+        }
+        return _regions;
+    }
+
+    bool isDirty(int tile_x,
+                 int tile_y) const {
+        return _dirty[(size_t)(tile_y * _tiles.width + tile_x)] != 0;
+    }
+
+    cv::Size tiles() const {
+        return _tiles;
+    }
+
+    // share of the tiles covered by the rects update() returned last
+    double activeRatio() const {
+        return _tiles.area() > 0 ? (double)_active / _tiles.area() : 0.0;
+    }
+
+private:
+    // tile rect, halo included, of the changed tiles reachable from (tx, ty)
+    // through changed tiles whose halos touch; marks them grouped
+    cv::Rect groupFrom(int tx,
+                       int ty) {
+        const int reach = 2 * _halo + 1;
+        cv::Rect group(tx, ty, 1, 1);
+
+        _stack.clear();
+        _stack.push_back(ty * _tiles.width + tx);
+        _grouped[(size_t)_stack.back()] = 1;
+
+        while (!_stack.empty()) {
+            const int x = _stack.back() % _tiles.width;
+            const int y = _stack.back() / _tiles.width;
+            _stack.pop_back();
+            group |= cv::Rect(x, y, 1, 1);
+
+            for (int ny = std::max(0, y - reach); ny <= std::min(_tiles.height - 1, y + reach); ++ny) {
+                for (int nx = std::max(0, x - reach); nx <= std::min(_tiles.width - 1, x + reach); ++nx) {
+                    const int idx = ny * _tiles.width + nx;
+                    if (isDirty(nx, ny) && !_grouped[(size_t)idx]) {
+                        _grouped[(size_t)idx] = 1;
+                        _stack.push_back(idx);
+                    }
+                }
+            }
+        }
+
+        group.x -= _halo;
+        group.y -= _halo;
+        group.width += 2 * _halo;
+        group.height += 2 * _halo;
+        return group & cv::Rect(0, 0, _tiles.width, _tiles.height);
+    }
+
+    // the bounding boxes of separate groups can still overlap; those are
+    // joined so no tile is run twice
+    void mergeOverlapping() {
+        bool merged = true;
+        while (merged) {
+            merged = false;
+            for (size_t i = 0; i < _tile_regions.size() && !merged; ++i) {
+                for (size_t j = i + 1; j < _tile_regions.size(); ++j) {
+                    if ((_tile_regions[i] & _tile_regions[j]).area() > 0) {
+                        _tile_regions[i] |= _tile_regions[j];
+                        _tile_regions.erase(_tile_regions.begin() + j);
+                        merged = true;
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    bool tileChanged(const cv::Mat& prev,
+                     const cv::Mat& curr,
+                     int tile_x,
+                     int tile_y) const {
+        const int channels = curr.channels();
+        const int x0 = tile_x * _tile_size;
+        const int y0 = tile_y * _tile_size;
+        const int x1 = std::min(x0 + _tile_size, curr.cols);
+        const int y1 = std::min(y0 + _tile_size, curr.rows);
+
+        int sad = 0;
+        int samples = 0;
+        for (int y = y0 + SAMPLE_STEP / 2; y < y1; y += SAMPLE_STEP) {
+            const uint8_t* a = prev.ptr<uint8_t>(y);
+            const uint8_t* b = curr.ptr<uint8_t>(y);
+
+            for (int x = x0; x < x1; x += SAMPLE_STEP) {
+                for (int c = 0; c < channels; ++c) {
+                    sad += std::abs((int)a[x * channels + c] - (int)b[x * channels + c]);
+                }
+                ++samples;
+            }
+        }
+
+        return samples > 0 && sad > _threshold * samples * channels;
+    }
+
+    int _tile_size;
+    int _halo;
+    int _threshold;
+
+    cv::Size _frame_size;
+    cv::Size _tiles;
+    std::vector<uint8_t> _dirty;
+    int _active;
+
+    // update()'s scratch, kept so it does not allocate once warmed up
+    std::vector<uint8_t> _grouped;
+    std::vector<int> _stack;
+    std::vector<cv::Rect> _tile_regions;
+    std::vector<cv::Rect> _regions;
+};
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef _ARKANOID_DETECTOR_POOL_H_
+#define _ARKANOID_DETECTOR_POOL_H_
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <image.h>
+#include "motion_detector.h"
+
+/*
+ * Runs the per-frame half of MotionDetector on several worker threads.
+ *
+ * Each worker owns a MotionDetector used only for its stateless part
+ * (preprocessFrame() and detectMotion()). Frames are submitted one at a
+ * time; the worker that takes a frame preprocesses it once and leaves the
+ * result for the worker of the next frame, which uses it as its previous
+ * frame. Finished detections go through a reorder buffer and are handed to
+ * the sink strictly in submission order, one at a time, so the sink can
+ * feed MotionDetector::integrate() and keep marker tracking sequential. The
+ * sink runs on whichever worker completed the next frame in order, outside
+ * the lock, so the other workers can keep finishing frames meanwhile. The
+ * contour vectors integrate() hands back return to the workers with later
+ * jobs, so detectMotion() writes over them instead of allocating.
+ *
+ * A frame can come with a search window (MotionDetector::searchWindow() of
+ * the tracking detector) to look for motion only there. The workers run up
+ * to `2 * workers` frames ahead of the detections the sink has seen, so the
+ * window is that much older than on the sequential path.
+ */
+class DetectorPool
+{
+public:
+    // may leave vectors in detection.contours for the workers to reuse, as
+    // integrate() does
+    typedef std::function<void(MotionDetector::Detection&)> Sink;
+
+    DetectorPool(size_t workers,
+                 size_t width,
+                 size_t height,
+                 const MotionDetector::Settings& settings,
+                 Sink sink):
+        _sink(std::move(sink)),
+        _frame_size((int)width, (int)height),
+        _stopping(false),
+        _in_flight(0),
+        _max_in_flight(workers * 2),
+        _submitted(0),
+        _delivering(false),
+        _next_to_deliver(0)
+    {
+        for (size_t i = 0; i < workers; ++i) {
+            MotionDetector detector(width, height);
+            detector.settings = settings;
+            _workers.emplace_back(&DetectorPool::work, this, std::move(detector));
+        }
+    }
+
+    DetectorPool(const DetectorPool&) = delete;
+    DetectorPool& operator =(const DetectorPool&) = delete;
+
+    ~DetectorPool() {
+        {
+            std::lock_guard<decltype(_jobs_mutex)> lock(_jobs_mutex);
+            _stopping = true;
+        }
+        _jobs_ready.notify_all();
+
+        for (std::thread& worker: _workers) {
+            worker.join();
+        }
+    }
+
+    // queues the next camera frame; the first one only becomes the previous
+    // frame of the second and gets no detection. Blocks while the workers
+    // are `2 * workers` frames behind, returns false if that outlasts timeout
+    template<typename Rep, typename Period>
+    bool submit(const Image& frame,
+                const std::chrono::duration<Rep, Period>& timeout) {
+        return submit(frame, cv::Rect(cv::Point(0, 0), _frame_size), timeout);
+    }
+
+    // as above, looking for motion only inside `search_window`, in camera
+    // frame coordinates
+    template<typename Rep, typename Period>
+    bool submit(const Image& frame,
+                const cv::Rect& search_window,
+                const std::chrono::duration<Rep, Period>& timeout) {
+        std::unique_lock<decltype(_jobs_mutex)> lock(_jobs_mutex);
+
+        if (!_space_ready.wait_for(lock, timeout, [this] { return _in_flight < _max_in_flight; })) {
+            return false;
+        }
+
+        _jobs.push_back({ _submitted++, frame, search_window });
+        ++_in_flight;
+        lock.unlock();
+
+        _jobs_ready.notify_one();
+        return true;
+    }
+
+    size_t workers() const {
+        return _workers.size();
+    }
+
+private:
+    struct Job
+    {
+        unsigned long long sequence;
+        Image frame;
+        cv::Rect search_window;
+    };
+
+    void work(MotionDetector detector) {
+        while (true) {
+            Job job;
+            std::vector<std::vector<cv::Point>> spare_contours;
+            {
+                std::unique_lock<decltype(_jobs_mutex)> lock(_jobs_mutex);
+                _jobs_ready.wait(lock, [this] { return _stopping || !_jobs.empty(); });
+                if (_jobs.empty()) {
+                    return;
+                }
+
+                job = std::move(_jobs.front());
+                _jobs.pop_front();
+
+                if (!_spare_contours.empty()) {
+                    spare_contours.swap(_spare_contours.back());
+                    _spare_contours.pop_back();
+                }
+            }
+            detector.recycleContours(spare_contours);
+
+            Image curr = detector.preprocessFrame(job.frame);
+            Image prev = exchangePreprocessed(job.sequence, curr);
+
+            // an empty detection only keeps the delivery order
+            MotionDetector::Detection detection;
+            if (!prev.empty()) {
+                detection = detector.detectMotion(prev, curr, toPreprocessed(job.search_window, curr.size()));
+                detection.source = std::move(job.frame);
+            }
+
+            complete(job.sequence, std::move(detection));
+        }
+    }
+
+    // `window`, in camera frame coordinates, in those of a preprocessed
+    // frame of `frame_size`
+    cv::Rect toPreprocessed(const cv::Rect& window,
+                            const cv::Size& frame_size) const {
+        cv::Point2f scale((float)frame_size.width / _frame_size.width,
+                          (float)frame_size.height / _frame_size.height);
+        cv::Rect scaled((int)(window.x * scale.x), (int)(window.y * scale.y),
+                        (int)std::ceil(window.width * scale.x), (int)std::ceil(window.height * scale.y));
+        return scaled & cv::Rect(0, 0, frame_size.width, frame_size.height);
+    }
+
+    // leaves frame `sequence` preprocessed for the next one, and waits for
+    // and takes the previous one, if there is one. That was queued first, so
+    // its worker is already on it and never waits on this one
+    Image exchangePreprocessed(unsigned long long sequence,
+                               const Image& curr) {
+        std::unique_lock<decltype(_preprocessed_mutex)> lock(_preprocessed_mutex);
+        _preprocessed.emplace(sequence, curr);
+        _preprocessed_ready.notify_all();
+
+        if (sequence == 0) {
+            return Image();
+        }
+
+        _preprocessed_ready.wait(lock, [this, sequence] { return _preprocessed.count(sequence - 1) > 0; });
+        auto prev = _preprocessed.find(sequence - 1);
+        Image ret = std::move(prev->second);
+        _preprocessed.erase(prev);
+        return ret;
+    }
+
+    void complete(unsigned long long sequence,
+                  MotionDetector::Detection&& detection) {
+        std::unique_lock<decltype(_order_mutex)> lock(_order_mutex);
+        _reorder.emplace(sequence, std::move(detection));
+
+        // one thread delivers at a time, which keeps the order; the others
+        // leave their detections to it
+        if (_delivering) {
+            return;
+        }
+        _delivering = true;
+
+        while (!_reorder.empty() && _reorder.begin()->first == _next_to_deliver) {
+            MotionDetector::Detection ready = std::move(_reorder.begin()->second);
+            _reorder.erase(_reorder.begin());
+            ++_next_to_deliver;
+            lock.unlock();
+
+            if (!ready.frame.empty()) {
+                _sink(ready);
+            }
+
+            {
+                std::lock_guard<decltype(_jobs_mutex)> jobs_lock(_jobs_mutex);
+                --_in_flight;
+                if (!ready.contours.empty() && _spare_contours.size() < _max_in_flight) {
+                    _spare_contours.push_back(std::move(ready.contours));
+                }
+            }
+            _space_ready.notify_one();
+
+            lock.lock();
+        }
+        _delivering = false;
+    }
+
+    Sink _sink;
+    const cv::Size _frame_size;
+
+    std::mutex _jobs_mutex;
+    std::condition_variable _jobs_ready;
+    std::condition_variable _space_ready;
+    std::deque<Job> _jobs;
+    bool _stopping;
+    size_t _in_flight;
+    const size_t _max_in_flight;
+    unsigned long long _submitted;
+    std::vector<std::vector<std::vector<cv::Point>>> _spare_contours;
+
+    // preprocessed frames waiting for the job of the frame after them
+    std::mutex _preprocessed_mutex;
+    std::condition_variable _preprocessed_ready;
+    std::map<unsigned long long, Image> _preprocessed;
+
+    // never held together with _jobs_mutex
+    std::mutex _order_mutex;
+    std::map<unsigned long long, MotionDetector::Detection> _reorder;
+    bool _delivering;
+    unsigned long long _next_to_deliver;
+
+    std::vector<std::thread> _workers;
+};
+
+#endif
@@ -0,0 +1,187 @@
+#ifndef _ARKANOID_FLOW_TRACKER_H_
+#define _ARKANOID_FLOW_TRACKER_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Follows a handful of corner features on the marker with pyramidal
+ * Lucas-Kanade, so the marker is kept while it stands still, which frame
+ * differencing cannot do.
+ *
+ * Points are seeded once inside a region the caller found the marker in and
+ * tracked from frame to frame; the flow is only computed over a window
+ * around them. Points LK loses, or that move unlike the rest, are dropped;
+ * once too few are left the track is lost and the caller has to seed again.
+ */
+class FlowTracker
+{
+public:
+    FlowTracker(int max_points = 32,
+                int min_points = 8,
+                int window_size = 15,
+                int levels = 2,
+                float max_error = 20.0f,
+                float max_deviation = 6.0f):
+        _max_points(max_points),
+        _min_points(min_points),
+        _window_size(window_size),
+        _levels(levels),
+        _max_error(max_error),
+        _max_deviation(max_deviation),
+        _seeded(0)
+    {}
+
+    // replaces the points with the strongest corners of `grey` (8-bit single
+    // channel) inside `region`; false if too few were found to track
+    bool seed(const cv::Mat& grey,
+              const cv::Rect& region) {
+        _points.clear();
+        _seeded = 0;
+
+        cv::Rect roi = region & cv::Rect(0, 0, grey.cols, grey.rows);
+        if (roi.area() == 0) {
+            return false;
+        }
+
+        cv::goodFeaturesToTrack(grey(roi), _points, _max_points, 0.01, 5.0);
+        for (cv::Point2f& p: _points) {
+            p.x += roi.x;
+            p.y += roi.y;
+        }
+
+        _seeded = _points.size();
+        if (!tracking()) {
+            _points.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // moves the points from `prev_grey` to `grey`; false, with no points
+    // left, once the track is lost
+    bool track(const cv::Mat& prev_grey,
+               const cv::Mat& grey) {
+        if (!tracking()) {
+            return false;
+        }
+
+        // the points plus as far as LK can reach from them at the top level
+        const int reach = (_window_size / 2 + 1) << _levels;
+        cv::Rect roi = bounds();
+        roi.x -= reach;
+        roi.y -= reach;
+        roi.width += 2 * reach;
+        roi.height += 2 * reach;
+        roi &= cv::Rect(0, 0, grey.cols, grey.rows);
+
+        _local.resize(_points.size());
+        for (size_t i = 0; i < _points.size(); ++i) {
+            _local[i] = { _points[i].x - roi.x, _points[i].y - roi.y };
+        }
+
+        cv::calcOpticalFlowPyrLK(prev_grey(roi), grey(roi), _local, _next, _status, _error,
+                                 cv::Size(_window_size, _window_size), _levels,
+                                 cv::TermCriteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20, 0.03));
+
+        // the marker moves as a whole: a point that does not follow the
+        // median displacement slid off it
+        _dx.clear();
+        _dy.clear();
+        for (size_t i = 0; i < _next.size(); ++i) {
+            if (_status[i] && _error[i] <= _max_error) {
+                _dx.push_back(_next[i].x - _local[i].x);
+                _dy.push_back(_next[i].y - _local[i].y);
+            }
+        }
+        if (_dx.size() < (size_t)_min_points) {
+            _points.clear();
+            return false;
+        }
+        cv::Point2f shift(median(_dx), median(_dy));
+
+        size_t kept = 0;
+        for (size_t i = 0; i < _next.size(); ++i) {
+            cv::Point2f d = _next[i] - _local[i] - shift;
+            if (!_status[i] || _error[i] > _max_error
+                    || d.x * d.x + d.y * d.y > _max_deviation * _max_deviation) {
+                continue;
+            }
+            _points[kept++] = { _next[i].x + roi.x, _next[i].y + roi.y };
+        }
+        _points.resize(kept);
+
+        if (!tracking()) {
+            _points.clear();
+            return false;
+        }
+        return true;
+    }
+
+    // enough points left, and at least half of the seeded ones
+    bool tracking() const {
+        return _points.size() >= (size_t)_min_points && _points.size() * 2 >= _seeded;
+    }
+
+    // share of the seeded points still tracked
+    double quality() const {
+        return _seeded > 0 ? (double)_points.size() / _seeded : 0.0;
+    }
+
+    const std::vector<cv::Point2f>& points() const {
+        return _points;
+    }
+
+    cv::Point2f center() const {
+        cv::Point2f sum(0, 0);
+        for (const cv::Point2f& p: _points) {
+            sum += p;
+        }
+        return _points.empty() ? sum : sum * (1.0f / _points.size());
+    }
+
+    cv::Rect bounds() const {
+        if (_points.empty()) {
+            return cv::Rect();
+        }
+
+        cv::Point2f lo = _points[0];
+        cv::Point2f hi = _points[0];
+        for (const cv::Point2f& p: _points) {
+            lo.x = std::min(lo.x, p.x);
+            lo.y = std::min(lo.y, p.y);
+            hi.x = std::max(hi.x, p.x);
+            hi.y = std::max(hi.y, p.y);
+        }
+        return { (int)lo.x, (int)lo.y, (int)(hi.x - lo.x) + 1, (int)(hi.y - lo.y) + 1 };
+    }
+
+private:
+    // partially sorts `values`
+    static float median(std::vector<float>& values) {
+        std::nth_element(values.begin(), values.begin() + values.size() / 2, values.end());
+        return values[values.size() / 2];
+    }
+
+    int _max_points;
+    int _min_points;
+    int _window_size;
+    int _levels;
+    float _max_error;
+    float _max_deviation;
+
+    std::vector<cv::Point2f> _points;
+    size_t _seeded;
+
+    // scratch, kept so tracking does not allocate once warmed up
+    std::vector<cv::Point2f> _local;
+    std::vector<cv::Point2f> _next;
+    std::vector<uint8_t> _status;
+    std::vector<float> _error;
+    std::vector<float> _dx;
+    std::vector<float> _dy;
+};
+
+#endif
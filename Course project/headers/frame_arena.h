@@ -0,0 +1,166 @@
+#ifndef _ARKANOID_FRAME_ARENA_H_
+#define _ARKANOID_FRAME_ARENA_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+#include <image.h>
+
+/*
+ * Bump allocator for temporaries that die within one frame.
+ *
+ * Serves cv::Mat buffers, as a cv::MatAllocator, and raw bytes through
+ * allocateBytes(). Freeing is a no-op; reset() takes everything back at
+ * once by rewinding a pointer. Requests that do not fit are served from
+ * the heap for the rest of the frame, and the next reset() grows the block
+ * to the frame's high-water mark, so in steady state nothing reaches malloc.
+ *
+ * MotionDetector uses it only for the step-by-step motion mask
+ * (fused_motion_kernel off), whose intermediate Mats it backs; the fused
+ * kernel keeps its own buffers and never creates an arena. Contours are
+ * recycled from frame to frame instead (MotionDetector::recycleContours()).
+ *
+ * Single-threaded: one arena per detector. Every Mat allocated from it must
+ * be released before reset().
+ */
+class FrameArena: public cv::MatAllocator
+{
+public:
+    static constexpr size_t MAT_ALIGNMENT = 64;
+
+    explicit FrameArena(size_t capacity = (size_t)1 << 20):
+        _block(nullptr),
+        _capacity(0),
+        _used(0),
+        _overflow_bytes(0),
+        _high_water(0),
+        _live_mats(0)
+    {
+        grow(capacity);
+    }
+
+    FrameArena(const FrameArena&) = delete;
+    FrameArena& operator =(const FrameArena&) = delete;
+
+    ~FrameArena() {
+        releaseOverflow();
+        cv::fastFree(_block);
+    }
+
+    // `bytes` aligned to `alignment`, a power of two up to MAT_ALIGNMENT
+    void* allocateBytes(size_t bytes,
+                        size_t alignment = alignof(std::max_align_t)) const {
+        size_t offset = (_used + alignment - 1) & ~(alignment - 1);
+
+        if (offset + bytes > _capacity) {
+            // as much as the block would need for it after the rest
+            _overflow_bytes += bytes + alignment;
+            _high_water = std::max(_high_water, _used + _overflow_bytes);
+
+            void* ptr = cv::fastMalloc(std::max<size_t>(bytes, 1));
+            _overflow.push_back(ptr);
+            return ptr;
+        }
+
+        _used = offset + bytes;
+        _high_water = std::max(_high_water, _used + _overflow_bytes);
+        return _block + offset;
+    }
+
+    // takes back everything allocated since the last reset()
+    void reset() {
+        CV_Assert(_live_mats == 0);
+
+        if (!_overflow.empty()) {
+            releaseOverflow();
+            grow(_high_water + _high_water / 2);
+        }
+        _used = 0;
+        _overflow_bytes = 0;
+        _high_water = 0;
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+    // bytes handed out since the last reset(), overflow included
+    size_t used() const {
+        return _high_water;
+    }
+
+    cv::UMatData* allocate(int dims,
+                           const int* sizes,
+                           int type,
+                           void* data,
+                           size_t* step,
+                           mat_access_flag flags,
+                           cv::UMatUsageFlags usage_flags) const override {
+        if (data) {
+            return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data,
+                                                        step, flags, usage_flags);
+        }
+
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            if (step) {
+                step[i] = total;
+            }
+            total *= sizes[i];
+        }
+
+        cv::UMatData* u = new (allocateBytes(sizeof(cv::UMatData), alignof(cv::UMatData)))
+                cv::UMatData(this);
+        u->data = u->origdata = (uchar*)allocateBytes(total, MAT_ALIGNMENT);
+        u->size = total;
+
+        ++_live_mats;
+        return u;
+    }
+
+    bool allocate(cv::UMatData* data,
+                  mat_access_flag,
+                  cv::UMatUsageFlags) const override {
+        return data != nullptr;
+    }
+
+    // the memory itself comes back on reset()
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) {
+            return;
+        }
+
+        CV_Assert(u->refcount == 0 && u->urefcount == 0);
+        u->origdata = nullptr;
+        u->~UMatData();
+        --_live_mats;
+    }
+
+private:
+    void grow(size_t capacity) {
+        cv::fastFree(_block);
+        _block = (uint8_t*)cv::fastMalloc(capacity);
+        _capacity = capacity;
+    }
+
+    void releaseOverflow() const {
+        for (void* ptr: _overflow) {
+            cv::fastFree(ptr);
+        }
+        _overflow.clear();
+    }
+
+    uint8_t* _block;
+    size_t _capacity;
+    mutable size_t _used;
+    mutable size_t _overflow_bytes;         // served from the heap this frame
+    mutable size_t _high_water;
+    mutable size_t _live_mats;
+    mutable std::vector<void*> _overflow;
+};
+
+#endif
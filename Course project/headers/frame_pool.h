@@ -0,0 +1,180 @@
+#ifndef _ARKANOID_FRAME_POOL_H_
+#define _ARKANOID_FRAME_POOL_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <image.h>
+
+/*
+ * Recycles Image buffers of one geometry.
+ *
+ * Images handed out by acquire() use the pool as their cv::MatAllocator, so
+ * when the last cv::Mat referencing a buffer is released, OpenCV returns it
+ * through deallocate() and the next acquire() picks it up again instead of
+ * going to the heap. Allocations of any other size fall through to the
+ * standard OpenCV allocator.
+ *
+ * acquire() may be called from one thread while buffers are released from
+ * any other. The pool must outlive every Image it produced.
+ */
+class FramePool: public cv::MatAllocator
+{
+public:
+    struct Stats
+    {
+        size_t hits;
+        size_t misses;
+        size_t in_flight;
+        size_t peak_in_flight;
+    };
+
+    FramePool(const cv::Size& size,
+              int type):
+        _hits(0),
+        _misses(0),
+        _in_flight(0),
+        _peak_in_flight(0)
+    {
+        _free.reserve(16);
+        setGeometry(size, type);
+    }
+
+    FramePool(const FramePool&) = delete;
+    FramePool& operator =(const FramePool&) = delete;
+
+    ~FramePool() {
+        for (cv::UMatData* u: _free) {
+            destroy(u);
+        }
+    }
+
+    Image acquire() {
+        Image ret;
+        acquire(ret);
+        return ret;
+    }
+
+    // makes `image` a pooled buffer of the pool geometry, keeping its current
+    // one if it already is and nobody else references it
+    void acquire(Image& image) {
+        if (image.u && image.u->currAllocator == this
+                && image.u->refcount == 1
+                && image.size() == _size && image.type() == _type) {
+            return;
+        }
+
+        image.release();
+        image.allocator = this;
+        image.create(_size, _type);
+    }
+
+    // changes the geometry of buffers handed out from now on; buffers of the
+    // old geometry still in flight are freed when they come back
+    void setGeometry(const cv::Size& size,
+                     int type) {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+
+        _size = size;
+        _type = type;
+        _buffer_size = (size_t)size.area() * CV_ELEM_SIZE(type);
+
+        for (cv::UMatData* u: _free) {
+            destroy(u);
+        }
+        _free.clear();
+    }
+
+    Stats stats() const {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        return { _hits, _misses, _in_flight, _peak_in_flight };
+    }
+
+    cv::UMatData* allocate(int dims,
+                           const int* sizes,
+                           int type,
+                           void* data,
+                           size_t* step,
+                           mat_access_flag flags,
+                           cv::UMatUsageFlags usage_flags) const override {
+        size_t total = CV_ELEM_SIZE(type);
+        for (int i = dims - 1; i >= 0; --i) {
+            total *= sizes[i];
+        }
+
+        std::unique_lock<decltype(_mutex)> lock(_mutex);
+        if (data || total != _buffer_size) {
+            lock.unlock();
+            return cv::Mat::getStdAllocator()->allocate(dims, sizes, type, data,
+                                                        step, flags, usage_flags);
+        }
+
+        if (step) {
+            size_t elem_step = CV_ELEM_SIZE(type);
+            for (int i = dims - 1; i >= 0; --i) {
+                step[i] = elem_step;
+                elem_step *= sizes[i];
+            }
+        }
+
+        cv::UMatData* u;
+        if (!_free.empty()) {
+            u = _free.back();
+            _free.pop_back();
+            ++_hits;
+        } else {
+            u = new cv::UMatData(this);
+            u->data = u->origdata = (uchar*)cv::fastMalloc(total);
+            u->size = total;
+            ++_misses;
+        }
+
+        _peak_in_flight = std::max(_peak_in_flight, ++_in_flight);
+        return u;
+    }
+
+    bool allocate(cv::UMatData* data,
+                  mat_access_flag,
+                  cv::UMatUsageFlags) const override {
+        return data != nullptr;
+    }
+
+    void deallocate(cv::UMatData* u) const override {
+        if (!u) {
+            return;
+        }
+
+        CV_Assert(u->refcount == 0 && u->urefcount == 0);
+
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        --_in_flight;
+
+        if (u->size == _buffer_size) {
+            _free.push_back(u);
+        } else {
+            destroy(u);
+        }
+    }
+
+private:
+    static void destroy(cv::UMatData* u) {
+        cv::fastFree(u->origdata);
+        u->origdata = nullptr;
+        delete u;
+    }
+
+    cv::Size _size;
+    int _type;
+    size_t _buffer_size;
+
+    mutable std::mutex _mutex;
+    mutable std::vector<cv::UMatData*> _free;
+    mutable size_t _hits;
+    mutable size_t _misses;
+    mutable size_t _in_flight;
+    mutable size_t _peak_in_flight;
+};
+
+#endif
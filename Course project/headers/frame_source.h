@@ -0,0 +1,210 @@
+#ifndef _ARKANOID_FRAME_SOURCE_H_
+#define _ARKANOID_FRAME_SOURCE_H_
+
+#include <opencv2/opencv.hpp>
+#include <memory>
+#include <string>
+#include <utility>
+
+#include <image.h>
+
+/*
+ * Where CaptureThread gets its frames from.
+ *
+ * Live sources are paced by the device; offline sources (video files, image
+ * sequences, the synthetic scene) report the rate they were recorded at and
+ * can also be drained as fast as the consumer accepts frames.
+ */
+class FrameSource
+{
+public:
+    virtual ~FrameSource() = default;
+
+    virtual bool isOpened() const = 0;
+    virtual bool read(Image& frame) = 0;
+    virtual cv::Size frameSize() const = 0;
+
+    // nominal frames per second of an offline source, 0 for a live one
+    virtual double fps() const = 0;
+};
+
+class CameraSource: public FrameSource
+{
+public:
+    CameraSource(int index,
+                 const cv::Size& size,
+                 double fps):
+        _capture(index)
+    {
+        _capture.set(cv::CAP_PROP_FRAME_WIDTH, size.width);
+        _capture.set(cv::CAP_PROP_FRAME_HEIGHT, size.height);
+        _capture.set(cv::CAP_PROP_FPS, fps);
+    }
+
+    bool isOpened() const override {
+        return _capture.isOpened();
+    }
+
+    bool read(Image& frame) override {
+        return _capture.read(frame);
+    }
+
+    cv::Size frameSize() const override {
+        return { (int)_capture.get(cv::CAP_PROP_FRAME_WIDTH),
+                 (int)_capture.get(cv::CAP_PROP_FRAME_HEIGHT) };
+    }
+
+    double fps() const override {
+        return 0.0;
+    }
+
+private:
+    cv::VideoCapture _capture;
+};
+
+/*
+ * Video file or printf-style image sequence ("frames/%04d.png"), optionally
+ * rewinding to the first frame when the end is reached.
+ */
+class VideoFileSource: public FrameSource
+{
+public:
+    static constexpr double DEFAULT_FPS = 30.0;
+
+    VideoFileSource(const std::string& path,
+                    bool loop):
+        _path(path),
+        _capture(path),
+        _loop(loop)
+    {}
+
+    bool isOpened() const override {
+        return _capture.isOpened();
+    }
+
+    bool read(Image& frame) override {
+        if (_capture.read(frame)) {
+            return true;
+        }
+
+        if (!_loop || !_capture.open(_path)) {
+            return false;
+        }
+        return _capture.read(frame);
+    }
+
+    cv::Size frameSize() const override {
+        return { (int)_capture.get(cv::CAP_PROP_FRAME_WIDTH),
+                 (int)_capture.get(cv::CAP_PROP_FRAME_HEIGHT) };
+    }
+
+    double fps() const override {
+        double fps = _capture.get(cv::CAP_PROP_FPS);
+        if (fps <= 0.0) {
+            return DEFAULT_FPS;
+        }
+        return fps;
+    }
+
+private:
+    std::string _path;
+    cv::VideoCapture _capture;
+    bool _loop;
+};
+
+/*
+ * Procedural scene: a black marker moving along a Lissajous curve over a
+ * fixed textured background. Frame N is a pure function of N, so two runs
+ * see exactly the same input.
+ */
+class SyntheticSource: public FrameSource
+{
+public:
+    static constexpr double FPS = 60.0;
+    static constexpr int MARKER_RADIUS = 40;
+
+    explicit SyntheticSource(const cv::Size& size):
+        _background(size, CV_8UC3),
+        _frame_idx(0)
+    {
+        for (int y = 0; y < size.height; ++y) {
+            cv::Vec3b* row = _background.ptr<cv::Vec3b>(y);
+            for (int x = 0; x < size.width; ++x) {
+                bool checker = ((x / 40) + (y / 40)) % 2 != 0;
+                row[x][0] = (uchar)(checker ? 150 : 110);
+                row[x][1] = (uchar)(100 + (x * 100) / size.width);
+                row[x][2] = (uchar)(100 + ((x ^ y) & 0x1f));
+            }
+        }
+    }
+
+    bool isOpened() const override {
+        return true;
+    }
+
+    bool read(Image& frame) override {
+        _background.copyTo(frame);
+        cv::circle(frame, markerPosition(_frame_idx), MARKER_RADIUS,
+                   cv::Scalar(0, 0, 0), -1);
+        ++_frame_idx;
+        return true;
+    }
+
+    cv::Size frameSize() const override {
+        return _background.size();
+    }
+
+    double fps() const override {
+        return FPS;
+    }
+
+    // where the marker is drawn in frame `idx`, before the detector's flip
+    cv::Point markerPosition(size_t idx) const {
+        double t = (double)idx / FPS;
+        double cx = _background.cols / 2.0;
+        double cy = _background.rows / 2.0;
+
+        return { (int)(cx + cx * 0.7 * std::sin(t * 1.3)),
+                 (int)(cy + cy * 0.5 * std::sin(t * 2.1 + 0.5)) };
+    }
+
+private:
+    Image _background;
+    size_t _frame_idx;
+};
+
+struct FrameSourceSettings
+{
+    enum class Kind
+    {
+        Camera,
+        VideoFile,
+        Synthetic,
+    };
+
+    Kind kind = Kind::Camera;
+    int camera_index = 0;
+    std::string path;
+    bool loop = true;
+
+    // push frames as fast as the detector takes them instead of pacing them
+    // at the source rate; never drops a frame
+    bool free_run = false;
+};
+
+inline std::unique_ptr<FrameSource> openFrameSource(const FrameSourceSettings& settings,
+                                                    const cv::Size& size,
+                                                    double fps)
+{
+    switch (settings.kind) {
+    case FrameSourceSettings::Kind::VideoFile:
+        return std::unique_ptr<FrameSource>(new VideoFileSource(settings.path, settings.loop));
+    case FrameSourceSettings::Kind::Synthetic:
+        return std::unique_ptr<FrameSource>(new SyntheticSource(size));
+    case FrameSourceSettings::Kind::Camera:
+    default:
+        return std::unique_ptr<FrameSource>(new CameraSource(settings.camera_index, size, fps));
+    }
+}
+
+#endif
@@ -2,6 +2,26 @@
 #define _ARKANOID_IMAGE_H_
 
 #include <opencv2/opencv.hpp>
+#include <array>
+#include <utility>
+
+#include "image_kernels.h"
+
+// flags type of cv::MatAllocator::allocate(), which changed in OpenCV 4.2
+#if CV_VERSION_MAJOR > 4 || (CV_VERSION_MAJOR == 4 && CV_VERSION_MINOR >= 2)
+typedef cv::AccessFlag mat_access_flag;
+#else
+typedef int mat_access_flag;
+#endif
+
+// identifies a camera frame and everything derived from it
+struct FrameStamp
+{
+    unsigned long long sequence = 0;
+    long long capture_ns = 0;       // Timer::monotonicNanos() when captured
+    long long dequeued_ns = 0;      // when the detector picked it up
+    long long processed_ns = 0;     // when the detector finished with it
+};
 
 class Image: public cv::Mat
 {
@@ -11,9 +31,37 @@ public:
             cv::Mat(args...)
     { }
 
+    // the forwarding constructor above would otherwise take over copies from
+    // non-const Images and drop the stamp
+    Image(const Image&) = default;
+    Image(Image& other):
+            Image(static_cast<const Image&>(other))
+    { }
+    Image(Image&&) = default;
+    Image& operator =(const Image&) = default;
+    Image& operator =(Image&&) = default;
+
+    FrameStamp stamp;
+
+    /*
+     * Every helper returning a new Image also has an overload writing into
+     * `out`, whose buffer is reused when it already has the right geometry
+     * and type. Unless noted, `out` must not share data with the source.
+     */
+
     static Image fromChannels(const Image& b,
                               const Image& g,
                               const Image& r)
+    {
+        Image rgb;
+        fromChannels(b, g, r, rgb);
+        return rgb;
+    }
+
+    static void fromChannels(const Image& b,
+                             const Image& g,
+                             const Image& r,
+                             Image& out)
     {
         assert(r.size == g.size);
         assert(r.size == b.size);
@@ -21,12 +69,11 @@ public:
         assert(g.type() == CV_8UC1);
         assert(b.type() == CV_8UC1);
 
-        Image rgb(r.size(), CV_8UC3);
-        cv::insertChannel(r, rgb, 2);
-        cv::insertChannel(g, rgb, 1);
-        cv::insertChannel(b, rgb, 0);
-
-        return rgb;
+        out.create(r.size(), CV_8UC3);
+        for (int y = 0; y < out.rows; ++y) {
+            kernels::interleave3(b.ptr<uint8_t>(y), g.ptr<uint8_t>(y), r.ptr<uint8_t>(y),
+                                 out.ptr<uint8_t>(y), out.cols);
+        }
     }
 
     enum class FlipAxis
@@ -36,50 +83,87 @@ public:
 
     Image flipped(FlipAxis axis) const
     {
-        Image ret(size(), type());
-        cv::flip(*this, ret, (int) axis);
+        Image ret;
+        flipped(axis, ret);
         return ret;
     }
 
+    // `out` may be *this
+    void flipped(FlipAxis axis,
+                 Image& out) const
+    {
+        if (&out == this && axis == FlipAxis::Y && depth() == CV_8U) {
+            out.mirrorRows();
+            return;
+        }
+
+        if (&out != this) {
+            out.create(size(), type());
+            out.stamp = stamp;
+        }
+        cv::flip(*this, out, (int) axis);
+    }
+
+    // in place: every Image sharing the buffer sees the flip
     Image &flip(FlipAxis axis)
     {
-        return *this = flipped(axis);
+        flipped(axis, *this);
+        return *this;
     }
 
   Image toGreyscale() const
+    {
+        Image ret;
+        toGreyscale(ret);
+        return ret;
+    }
+
+    void toGreyscale(Image& out) const
     {
         assert(type() == CV_8UC3);
 
-        Image ret(size(), type(), 1);
-        cv::cvtColor(*this, ret, cv::COLOR_RGB2GRAY);
-        return ret;
+        cv::cvtColor(*this, out, cv::COLOR_RGB2GRAY);
     }
 
     Image toColored() const
+    {
+        Image ret;
+        toColored(ret);
+        return ret;
+    }
+
+    void toColored(Image& out) const
     {
         assert(type() == CV_8UC1);
 
-        Image ret(size(), type(), 3);
-        cv::cvtColor(*this, ret, cv::COLOR_GRAY2RGB);
-        return ret;
+        cv::cvtColor(*this, out, cv::COLOR_GRAY2RGB);
     }
 
     std::array<Image, 3> toChannels() const
     {
-        assert(type() == CV_8UC3);
-
         std::array<Image, 3> ret;
-        cv::extractChannel(*this, ret[0], 0);
-        cv::extractChannel(*this, ret[1], 1);
-        cv::extractChannel(*this, ret[2], 2);
-
+        toChannels(ret);
         return ret;
     }
 
+    void toChannels(std::array<Image, 3>& out) const
+    {
+        assert(type() == CV_8UC3);
+
+        // one pass over the pixels instead of one per extractChannel
+        for (Image& channel: out) {
+            channel.create(size(), CV_8UC1);
+        }
+        for (int y = 0; y < rows; ++y) {
+            kernels::deinterleave3(ptr<uint8_t>(y), out[0].ptr<uint8_t>(y), out[1].ptr<uint8_t>(y),
+                                   out[2].ptr<uint8_t>(y), cols);
+        }
+    }
+
     Image resized(const cv::Size &dst_size) const
     {
-        Image ret(dst_size, type());
-        cv::resize(*this, ret, dst_size);
+        Image ret;
+        resized(dst_size, ret);
         return ret;
     };
 
@@ -88,12 +172,51 @@ public:
         return resized({ width, height });
     }
 
+    void resized(const cv::Size &dst_size,
+                 Image& out) const
+    {
+        cv::resize(*this, out, dst_size);
+    }
+
     Image blurred(int kernel_size) const
     {
         Image ret;
-        cv::blur(*this, ret, { kernel_size, kernel_size });
+        blurred(kernel_size, ret);
         return ret;
     }
+
+    // `out` may be *this. 8-bit images with 1 or 3 channels go through
+    // kernels::BoxBlur, which rounds exactly where cv::blur may be a level
+    // off, as long as a column of the window sums into 16 bits
+    void blurred(int kernel_size,
+                 Image& out) const
+    {
+        if (depth() == CV_8U && (channels() == 1 || channels() == 3) &&
+            kernel_size % 2 == 1 && kernel_size * 255 <= 0xffff) {
+            kernels::boxBlur(*this, out, kernel_size);
+        } else {
+            cv::blur(*this, out, { kernel_size, kernel_size });
+        }
+    }
+
+private:
+    // flip around the Y axis in place; cv::flip builds an index table on
+    // the heap for every call
+    void mirrorRows()
+    {
+        const int channels = this->channels();
+
+        for (int y = 0; y < rows; ++y) {
+            uchar* left = ptr<uchar>(y);
+            uchar* right = left + (cols - 1) * channels;
+
+            for (; left < right; left += channels, right -= channels) {
+                for (int c = 0; c < channels; ++c) {
+                    std::swap(left[c], right[c]);
+                }
+            }
+        }
+    }
 };
 
 #endif
@@ -0,0 +1,267 @@
+#ifndef _ARKANOID_IMAGE_KERNELS_H_
+#define _ARKANOID_IMAGE_KERNELS_H_
+
+#include <opencv2/opencv.hpp>
+#include <cstdint>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#define ARKANOID_SSE2 1
+#endif
+
+// AVX2 code is compiled into every x86-64 build, for the CPUs that have it;
+// GCC and Clang need it marked per function since the build targets SSE2
+#if defined(ARKANOID_SSE2) && (defined(__GNUC__) || defined(_MSC_VER))
+#define ARKANOID_AVX2 1
+#endif
+
+/*
+ * Hand-written image kernels for the detector's hot path.
+ *
+ * Every kernel has a scalar reference implementation and vectorized ones
+ * selected by Isa; all are exact integer code and must produce identical
+ * output (arkanoid_bench checks that before timing them). A kernel asked
+ * for a level it has no code for runs the best lower one it has.
+ */
+namespace kernels {
+
+// instruction set levels, each a superset of the ones before it
+enum class Isa
+{
+    Scalar,
+    Sse2,
+    Avx2,
+};
+
+// the best level the CPU and the OS support, probed with CPUID on first use
+Isa supportedIsa();
+
+// supportedIsa(), unless the ARKANOID_ISA environment variable names a lower
+// level (scalar, sse2, avx2) to force for testing; a name it cannot apply
+// is reported on stderr. Decided on first use and fixed for the rest of the
+// run
+Isa bestIsa();
+
+const char* isaName(Isa isa);
+
+// false, leaving `isa` alone, if `name` is not an isaName()
+bool parseIsa(const char* name,
+              Isa& isa);
+
+// Binary mask of round(box_blur(src, ksize)) > threshold, 255 where true.
+// src is 8-bit single channel, ksize odd; borders are reflected like cv::blur.
+void boxThreshold(const cv::Mat& src,
+                  cv::Mat& dst,
+                  int ksize,
+                  int threshold,
+                  Isa isa);
+
+// same, with caller-owned scratch for the column sums
+void boxThreshold(const cv::Mat& src,
+                  cv::Mat& dst,
+                  int ksize,
+                  int threshold,
+                  Isa isa,
+                  std::vector<uint16_t>& column_sums);
+
+// n interleaved 3-channel pixels to three planar rows, and back
+void deinterleave3(const uint8_t* src,
+                   uint8_t* c0,
+                   uint8_t* c1,
+                   uint8_t* c2,
+                   int n,
+                   Isa isa = bestIsa());
+
+void interleave3(const uint8_t* c0,
+                 const uint8_t* c1,
+                 const uint8_t* c2,
+                 uint8_t* dst,
+                 int n,
+                 Isa isa = bestIsa());
+
+/*
+ * Box blur of 8-bit images with 1 or 3 channels, cv::blur with the default
+ * reflect-101 border but exactly rounded (cv::blur rounds kernels of up to
+ * 256 pixels through a fixed-point reciprocal and can be one level off).
+ *
+ * Separable running sums: every source row is summed horizontally once into
+ * a ring of ksize rows, and the column sums slide down the image by adding
+ * the row entering the window and subtracting the one leaving it, so the
+ * cost per pixel does not depend on ksize. The column pass and the division
+ * are vectorized across the row. dst may be src: the ring already holds
+ * every row the bottom border reflects back to.
+ *
+ * Keeps the ring and sums between calls; same-geometry calls do not allocate.
+ */
+class BoxBlur
+{
+public:
+    // ksize odd, ksize * 255 <= 65535. dst gets src's size and type
+    void run(const cv::Mat& src,
+             cv::Mat& dst,
+             int ksize,
+             Isa isa = bestIsa());
+
+private:
+    // ring slot of source row `row`, rows of n sums
+    uint16_t* ringRow(int row,
+                      int ksize,
+                      int n);
+
+    // horizontal sums of source row `row`, reflected at every border
+    void sumRow(const cv::Mat& src,
+                int row,
+                int ksize,
+                uint16_t* out);
+
+    std::vector<uint8_t> _padded;       // one source row, reflected by ksize / 2
+    std::vector<uint16_t> _ring;        // horizontal sums, ksize rows
+    std::vector<uint16_t> _entering;
+    std::vector<uint32_t> _column_sums;
+    cv::Mat _copy;                      // in place on images too short for the ring
+};
+
+// BoxBlur with a scratch per thread, kept between calls
+void boxBlur(const cv::Mat& src,
+             cv::Mat& dst,
+             int ksize,
+             Isa isa = bestIsa());
+
+/*
+ * Fused replacement for the OpenCV chain that used to live in
+ * MotionDetector::amplifyMotion: saturating frame difference, bilinear
+ * downscale, per-channel histogram equalization, RGB2GRAY weighting, box
+ * blur and threshold, in two passes over the (mostly downscaled) data.
+ *
+ * Keeps its lookup tables and scratch rows between calls, so running it on
+ * frames of one geometry does not allocate.
+ */
+class MotionMask
+{
+public:
+    MotionMask();
+
+    // prev/curr: 8-bit, 1 or 3 channels, same geometry. mask: CV_8UC1 of
+    // `small_size`, 0 or 255.
+    void run(const cv::Mat& prev,
+             const cv::Mat& curr,
+             const cv::Size& small_size,
+             int blur_size,
+             int threshold,
+             cv::Mat& mask,
+             Isa isa = bestIsa());
+
+private:
+    void prepare(const cv::Size& src_size,
+                 int channels,
+                 const cv::Size& small_size);
+
+    const uint8_t* diffRow(const cv::Mat& prev,
+                           const cv::Mat& curr,
+                           int row,
+                           Isa isa);
+
+    cv::Size _src_size;
+    cv::Size _small_size;
+    int _channels;
+
+    std::vector<int> _x_ofs;            // left source pixel, premultiplied by channels
+    std::vector<int> _x_ofs_right;
+    std::vector<int> _x_coef;           // weight of the left pixel, 11-bit fixed point
+    std::vector<int> _y_ofs;
+    std::vector<int> _y_coef;
+
+    std::vector<uint8_t> _diff_rows[2];
+    int _diff_row_idx[2];
+    int _next_diff_slot;
+
+    cv::Mat _planes;                    // one small plane per channel, stacked
+    cv::Mat _grey;
+    std::vector<uint16_t> _column_sums;
+    uint32_t _hist[3][256];
+    int _weighted_lut[3][256];
+};
+
+/*
+ * Colour key: 255 where a BGR pixel is within `tolerance` of the key colour
+ * in every channel, 0 elsewhere, through a lookup table indexed by the top
+ * BITS bits of each channel. Pixels are classified by the centre of their
+ * quantization cell, so the edge of the tolerance box is only exact to half
+ * a cell (4 levels).
+ *
+ * The table is 32 KB and only rebuilt when the key or tolerance changes.
+ */
+class ColourKey
+{
+public:
+    static constexpr int BITS = 5;
+
+    ColourKey();
+
+    // no-op if `colour` (B, G, R) and `tolerance` are the current key
+    void setKey(const cv::Scalar& colour,
+                int tolerance);
+
+    // src: CV_8UC3. mask: CV_8UC1 of the same size
+    void run(const cv::Mat& src,
+             cv::Mat& mask) const;
+
+private:
+    cv::Scalar _colour;
+    int _tolerance;
+    std::vector<uint8_t> _lut;
+};
+
+/*
+ * Running-average background model, the alternative to differencing
+ * consecutive frames: the mask marks where a frame departs from the recent
+ * past in either direction, not just where it got brighter.
+ *
+ * The model is one value per output pixel, the grey level of every `step`th
+ * source pixel in 8.8 fixed point, moved 1/2^learning_shift of the way
+ * towards each new frame. Comparison and update happen in a single pass over
+ * the sampled rows; the model is allocated when the frame geometry or step
+ * changes and reused afterwards.
+ */
+class BackgroundModel
+{
+public:
+    BackgroundModel();
+
+    // frame: 8-bit, 1 or 3 channels. mask: CV_8UC1 of size(), 255 where the
+    // sampled grey level is more than `threshold` away from the model's. The
+    // first frame of a geometry only initializes the model; its mask is 0
+    void run(const cv::Mat& frame,
+             int step,
+             int learning_shift,
+             int threshold,
+             cv::Mat& mask,
+             Isa isa = bestIsa());
+
+    // forget the background; the next run() starts over
+    void reset();
+
+    // size of the model and the mask
+    cv::Size size() const {
+        return _size;
+    }
+
+private:
+    void prepare(const cv::Size& frame_size,
+                 int channels,
+                 int step);
+
+    cv::Size _frame_size;
+    cv::Size _size;
+    int _channels;
+    int _step;
+    bool _initialized;
+
+    std::vector<int> _x_ofs;            // sampled source pixel, premultiplied by channels
+    std::vector<uint16_t> _model;       // 8.8 fixed point grey, row-major
+    std::vector<uint8_t> _samples;      // one row
+};
+
+}
+
+#endif
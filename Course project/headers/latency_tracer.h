@@ -0,0 +1,178 @@
+#ifndef _ARKANOID_LATENCY_TRACER_H_
+#define _ARKANOID_LATENCY_TRACER_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdio>
+#include <ostream>
+
+#include <image.h>
+
+/*
+ * Log-linear histogram of durations with microsecond resolution below
+ * 128 us and 32 sub-buckets per power of two above that (~3% error).
+ *
+ * Each histogram has a single writer; readers on other threads may dump it
+ * at any time and get a slightly torn but usable snapshot.
+ */
+class LatencyHistogram
+{
+public:
+    LatencyHistogram():
+        _count(0),
+        _max_ns(0)
+    {
+        for (auto& bucket: _buckets) {
+            bucket.store(0, std::memory_order_relaxed);
+        }
+    }
+
+    void record(long long ns) {
+        if (ns < 0) {
+            ns = 0;
+        }
+
+        _buckets[bucketFor((unsigned long long)ns / 1000)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        if (ns > _max_ns.load(std::memory_order_relaxed)) {
+            _max_ns.store(ns, std::memory_order_relaxed);
+        }
+    }
+
+    unsigned long long count() const {
+        return _count.load(std::memory_order_relaxed);
+    }
+
+    long long maxNanos() const {
+        return _max_ns.load(std::memory_order_relaxed);
+    }
+
+    // upper bound of the bucket holding the q-th quantile, q in [0, 1]
+    long long percentileNanos(double q) const {
+        unsigned long long total = count();
+        if (total == 0) {
+            return 0;
+        }
+
+        unsigned long long rank = (unsigned long long)(q * (double)(total - 1)) + 1;
+        unsigned long long seen = 0;
+        for (size_t i = 0; i < BUCKETS; ++i) {
+            seen += _buckets[i].load(std::memory_order_relaxed);
+            if (seen >= rank) {
+                return std::min((long long)bucketUpperMicros(i) * 1000, maxNanos());
+            }
+        }
+        return maxNanos();
+    }
+
+private:
+    static constexpr size_t LINEAR = 128;
+    static constexpr size_t SUB_BUCKETS = 32;
+    static constexpr size_t LINEAR_BITS = 7;
+    static constexpr size_t SUB_BITS = 5;
+    static constexpr size_t BUCKETS = LINEAR + (64 - LINEAR_BITS) * SUB_BUCKETS;
+
+    static size_t bucketFor(unsigned long long us) {
+        if (us < LINEAR) {
+            return (size_t)us;
+        }
+
+        size_t exponent = 63 - (size_t)__builtin_clzll(us);
+        size_t sub = (size_t)(us >> (exponent - SUB_BITS)) & (SUB_BUCKETS - 1);
+        return LINEAR + (exponent - LINEAR_BITS) * SUB_BUCKETS + sub;
+    }
+
+    static unsigned long long bucketUpperMicros(size_t idx) {
+        if (idx < LINEAR) {
+            return idx + 1;
+        }
+
+        size_t exponent = (idx - LINEAR) / SUB_BUCKETS + LINEAR_BITS;
+        size_t sub = (idx - LINEAR) % SUB_BUCKETS;
+        return ((unsigned long long)(SUB_BUCKETS + sub + 1)) << (exponent - SUB_BITS);
+    }
+
+    std::array<std::atomic<unsigned long long>, BUCKETS> _buckets;
+    std::atomic<unsigned long long> _count;
+    std::atomic<long long> _max_ns;
+};
+
+/*
+ * Per-stage and end-to-end latency of frames going through the pipeline.
+ *
+ * Frames carry a FrameStamp from the capture thread onwards; every stage
+ * records the time it took as soon as it knows both ends of it.
+ */
+class LatencyTracer
+{
+public:
+    enum Stage
+    {
+        CAPTURE_QUEUE,      // captured -> picked up by the detector
+        DETECT,             // picked up -> detection done, debug overlay captured
+        DISPLAY_QUEUE,      // detector done -> picked up by the render loop
+        PRESENT,            // picked up -> debug view composed, handed to the window
+        END_TO_END,         // captured -> handed to the window
+        MARKER,             // captured -> paddle moved
+        RENDER_LOOP,        // one iteration of the render loop, incl. waitKey
+        PREDICTION,         // marker latency hidden by extrapolating the paddle
+        STAGE_COUNT
+    };
+
+    LatencyTracer():
+        _last_displayed(0),
+        _displayed(0),
+        _skipped(0)
+    {}
+
+    void record(Stage stage,
+                long long start_ns,
+                long long end_ns) {
+        _stages[stage].record(end_ns - start_ns);
+    }
+
+    // called by the render loop for every frame it shows; gaps in the
+    // sequence are frames dropped or overwritten somewhere upstream
+    void frameDisplayed(const FrameStamp& stamp) {
+        unsigned long long last = _last_displayed.load(std::memory_order_relaxed);
+        if (last != 0 && stamp.sequence > last + 1) {
+            _skipped.fetch_add(stamp.sequence - last - 1, std::memory_order_relaxed);
+        }
+        _last_displayed.store(stamp.sequence, std::memory_order_relaxed);
+        _displayed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void dump(std::ostream& out) const {
+        static const char* const NAMES[STAGE_COUNT] = {
+            "capture queue", "detect", "display queue", "present",
+            "end to end", "marker", "render loop", "prediction",
+        };
+
+        char line[128];
+        std::snprintf(line, sizeof(line), "%-14s %8s %9s %9s %9s\n",
+                      "stage", "count", "p50 ms", "p99 ms", "max ms");
+        out << line;
+
+        for (int stage = 0; stage < STAGE_COUNT; ++stage) {
+            const LatencyHistogram& hist = _stages[stage];
+            std::snprintf(line, sizeof(line), "%-14s %8llu %9.2f %9.2f %9.2f\n",
+                          NAMES[stage], hist.count(),
+                          hist.percentileNanos(0.50) / 1e6,
+                          hist.percentileNanos(0.99) / 1e6,
+                          hist.maxNanos() / 1e6);
+            out << line;
+        }
+
+        out << "frames displayed: " << _displayed.load(std::memory_order_relaxed)
+            << ", skipped: " << _skipped.load(std::memory_order_relaxed) << "\n";
+    }
+
+private:
+    std::array<LatencyHistogram, STAGE_COUNT> _stages;
+    std::atomic<unsigned long long> _last_displayed;
+    std::atomic<unsigned long long> _displayed;
+    std::atomic<unsigned long long> _skipped;
+};
+
+#endif
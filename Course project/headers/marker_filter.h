@@ -0,0 +1,376 @@
+#ifndef _ARKANOID_MARKER_FILTER_H_
+#define _ARKANOID_MARKER_FILTER_H_
+
+#include <opencv2/opencv.hpp>
+#include <array>
+#include <cmath>
+#include <memory>
+#include <utility>
+
+/*
+ * Smoothing filters for the marker position, in normalized [0, 1] frame
+ * coordinates, stepped once per camera frame.
+ */
+
+// dense row-major matrix with its storage inline
+template<size_t Rows, size_t Cols>
+struct FixedMatrix
+{
+    std::array<float, Rows * Cols> data;
+
+    static FixedMatrix zeros() {
+        FixedMatrix ret;
+        ret.data.fill(0.0f);
+        return ret;
+    }
+
+    static FixedMatrix identity(float value = 1.0f) {
+        FixedMatrix ret = zeros();
+        for (size_t i = 0; i < Rows && i < Cols; ++i) {
+            ret(i, i) = value;
+        }
+        return ret;
+    }
+
+    float& operator ()(size_t row,
+                       size_t col) {
+        return data[row * Cols + col];
+    }
+
+    float operator ()(size_t row,
+                      size_t col) const {
+        return data[row * Cols + col];
+    }
+
+    FixedMatrix<Cols, Rows> t() const {
+        FixedMatrix<Cols, Rows> ret;
+        for (size_t r = 0; r < Rows; ++r) {
+            for (size_t c = 0; c < Cols; ++c) {
+                ret(c, r) = (*this)(r, c);
+            }
+        }
+        return ret;
+    }
+
+    FixedMatrix operator +(const FixedMatrix& other) const {
+        FixedMatrix ret;
+        for (size_t i = 0; i < Rows * Cols; ++i) {
+            ret.data[i] = data[i] + other.data[i];
+        }
+        return ret;
+    }
+
+    FixedMatrix operator -(const FixedMatrix& other) const {
+        FixedMatrix ret;
+        for (size_t i = 0; i < Rows * Cols; ++i) {
+            ret.data[i] = data[i] - other.data[i];
+        }
+        return ret;
+    }
+
+    template<size_t Other>
+    FixedMatrix<Rows, Other> operator *(const FixedMatrix<Cols, Other>& other) const {
+        FixedMatrix<Rows, Other> ret = FixedMatrix<Rows, Other>::zeros();
+        for (size_t r = 0; r < Rows; ++r) {
+            for (size_t k = 0; k < Cols; ++k) {
+                float lhs = (*this)(r, k);
+                for (size_t c = 0; c < Other; ++c) {
+                    ret(r, c) += lhs * other(k, c);
+                }
+            }
+        }
+        return ret;
+    }
+
+    // Gauss-Jordan with partial pivoting; false if the matrix is singular
+    bool invert(FixedMatrix& out) const {
+        static_assert(Rows == Cols, "only square matrices can be inverted");
+
+        FixedMatrix a = *this;
+        out = identity();
+
+        for (size_t col = 0; col < Rows; ++col) {
+            size_t pivot = col;
+            for (size_t r = col + 1; r < Rows; ++r) {
+                if (std::fabs(a(r, col)) > std::fabs(a(pivot, col))) {
+                    pivot = r;
+                }
+            }
+            if (a(pivot, col) == 0.0f) {
+                return false;
+            }
+
+            for (size_t c = 0; c < Cols; ++c) {
+                std::swap(a(col, c), a(pivot, c));
+                std::swap(out(col, c), out(pivot, c));
+            }
+
+            float scale = 1.0f / a(col, col);
+            for (size_t c = 0; c < Cols; ++c) {
+                a(col, c) *= scale;
+                out(col, c) *= scale;
+            }
+
+            for (size_t r = 0; r < Rows; ++r) {
+                float factor = a(r, col);
+                if (r == col || factor == 0.0f) {
+                    continue;
+                }
+                for (size_t c = 0; c < Cols; ++c) {
+                    a(r, c) -= factor * a(col, c);
+                    out(r, c) -= factor * out(col, c);
+                }
+            }
+        }
+        return true;
+    }
+};
+
+/*
+ * Linear Kalman filter sized at compile time: N state variables, M measured
+ * ones, no control input. Same equations as cv::KalmanFilter, without the
+ * temporaries it allocates on every step.
+ */
+template<size_t N, size_t M>
+class FixedKalmanFilter
+{
+public:
+    typedef FixedMatrix<N, 1> State;
+    typedef FixedMatrix<M, 1> Measurement;
+
+    FixedKalmanFilter():
+        state(State::zeros()),
+        transition(FixedMatrix<N, N>::identity()),
+        measurement(FixedMatrix<M, N>::identity()),
+        process_noise(FixedMatrix<N, N>::identity()),
+        measurement_noise(FixedMatrix<M, M>::identity()),
+        error_cov(FixedMatrix<N, N>::identity())
+    {}
+
+    const State& predict() {
+        state = transition * state;
+        error_cov = transition * error_cov * transition.t() + process_noise;
+        return state;
+    }
+
+    const State& correct(const Measurement& z) {
+        FixedMatrix<N, M> pht = error_cov * measurement.t();
+        FixedMatrix<M, M> innovation_cov = measurement * pht + measurement_noise;
+
+        FixedMatrix<M, M> innovation_cov_inv;
+        if (!innovation_cov.invert(innovation_cov_inv)) {
+            return state;
+        }
+
+        FixedMatrix<N, M> gain = pht * innovation_cov_inv;
+        state = state + gain * (z - measurement * state);
+        error_cov = (FixedMatrix<N, N>::identity() - gain * measurement) * error_cov;
+        return state;
+    }
+
+    State state;
+    FixedMatrix<N, N> transition;
+    FixedMatrix<M, N> measurement;
+    FixedMatrix<N, N> process_noise;
+    FixedMatrix<M, M> measurement_noise;
+    FixedMatrix<N, N> error_cov;
+};
+
+class PositionFilter
+{
+public:
+    virtual ~PositionFilter() = default;
+
+    // steps the filter one frame forward and returns where it expects the
+    // marker in that frame
+    virtual cv::Point2f predict() = 0;
+
+    virtual void correct(const cv::Point2f& measurement) = 0;
+
+    // forgets the history: at rest at `position`
+    virtual void reset(const cv::Point2f& position) = 0;
+
+    // estimate after the last correct(), and its change per frame
+    virtual cv::Point2f position() const = 0;
+    virtual cv::Point2f velocity() const = 0;
+};
+
+enum class PositionFilterKind
+{
+    Kalman,             // FixedKalmanFilter, constant velocity model
+    OneEuro,
+    OpenCvKalman,       // cv::KalmanFilter, kept as the reference
+};
+
+/*
+ * Constant velocity Kalman filter over (x, y, dx, dy), with the noise
+ * levels Marker has always used.
+ */
+class KalmanPositionFilter: public PositionFilter
+{
+public:
+    KalmanPositionFilter() {
+        _kalman.transition(0, 2) = 1.0f;
+        _kalman.transition(1, 3) = 1.0f;
+        _kalman.process_noise = FixedMatrix<4, 4>::identity(1e-1f);
+        _kalman.measurement_noise = FixedMatrix<2, 2>::identity(10.0f);
+        _kalman.error_cov = FixedMatrix<4, 4>::identity(.5f);
+    }
+
+    void reset(const cv::Point2f& position) override {
+        _kalman.state = FixedMatrix<4, 1>::zeros();
+        _kalman.state(0, 0) = position.x;
+        _kalman.state(1, 0) = position.y;
+        _kalman.error_cov = FixedMatrix<4, 4>::identity(.5f);
+    }
+
+    cv::Point2f predict() override {
+        const FixedMatrix<4, 1>& state = _kalman.predict();
+        return { state(0, 0), state(1, 0) };
+    }
+
+    void correct(const cv::Point2f& measurement) override {
+        FixedMatrix<2, 1> z;
+        z(0, 0) = measurement.x;
+        z(1, 0) = measurement.y;
+        _kalman.correct(z);
+    }
+
+    cv::Point2f position() const override {
+        return { _kalman.state(0, 0), _kalman.state(1, 0) };
+    }
+
+    cv::Point2f velocity() const override {
+        return { _kalman.state(2, 0), _kalman.state(3, 0) };
+    }
+
+private:
+    FixedKalmanFilter<4, 2> _kalman;
+};
+
+/*
+ * One Euro filter (Casiez et al., CHI 2012): a low-pass filter whose cutoff
+ * rises with the speed of the signal, so slow movement is smoothed hard and
+ * fast movement lags little. Does no prediction of its own.
+ */
+class OneEuroPositionFilter: public PositionFilter
+{
+public:
+    OneEuroPositionFilter(double rate = 30.0,
+                          double min_cutoff = 1.0,
+                          double beta = 2.0,
+                          double derivative_cutoff = 1.0):
+        _rate(rate),
+        _min_cutoff(min_cutoff),
+        _beta(beta),
+        _derivative_cutoff(derivative_cutoff),
+        _initialized(false)
+    {}
+
+    cv::Point2f predict() override {
+        return _position;
+    }
+
+    void reset(const cv::Point2f& position) override {
+        _position = position;
+        _velocity = { 0.0f, 0.0f };
+        _initialized = true;
+    }
+
+    void correct(const cv::Point2f& measurement) override {
+        if (!_initialized) {
+            _position = measurement;
+            _velocity = { 0.0f, 0.0f };
+            _initialized = true;
+            return;
+        }
+
+        cv::Point2f raw_velocity = measurement - _position;
+        _velocity += (raw_velocity - _velocity) * alpha(_derivative_cutoff);
+
+        double speed = std::sqrt(_velocity.x * _velocity.x + _velocity.y * _velocity.y) * _rate;
+        _position += (measurement - _position) * alpha(_min_cutoff + _beta * speed);
+    }
+
+    cv::Point2f position() const override {
+        return _position;
+    }
+
+    cv::Point2f velocity() const override {
+        return _velocity;
+    }
+
+private:
+    float alpha(double cutoff) const {
+        double tau = 1.0 / (2.0 * CV_PI * cutoff);
+        return (float)(1.0 / (1.0 + tau * _rate));
+    }
+
+    double _rate;
+    double _min_cutoff;
+    double _beta;
+    double _derivative_cutoff;
+
+    bool _initialized;
+    cv::Point2f _position;
+    cv::Point2f _velocity;
+};
+
+class OpenCvKalmanPositionFilter: public PositionFilter
+{
+public:
+    OpenCvKalmanPositionFilter():
+        _kalman(4, 2, 0)
+    {
+        _kalman.statePre = cv::Mat::zeros(4, 1, CV_32F);
+        cv::setIdentity(_kalman.transitionMatrix);
+        _kalman.transitionMatrix.at<float>(0, 2) = 1.0f;
+        _kalman.transitionMatrix.at<float>(1, 3) = 1.0f;
+        cv::setIdentity(_kalman.measurementMatrix);
+        cv::setIdentity(_kalman.processNoiseCov, cv::Scalar::all(1e-1));
+        cv::setIdentity(_kalman.measurementNoiseCov, cv::Scalar::all(10));
+        cv::setIdentity(_kalman.errorCovPost, cv::Scalar::all(.5));
+    }
+
+    cv::Point2f predict() override {
+        const cv::Mat& prediction = _kalman.predict();
+        return { prediction.at<float>(0), prediction.at<float>(1) };
+    }
+
+    void correct(const cv::Point2f& measurement) override {
+        _kalman.correct(cv::Mat(measurement));
+    }
+
+    void reset(const cv::Point2f& position) override {
+        _kalman.statePost = cv::Mat::zeros(4, 1, CV_32F);
+        _kalman.statePost.at<float>(0) = position.x;
+        _kalman.statePost.at<float>(1) = position.y;
+        cv::setIdentity(_kalman.errorCovPost, cv::Scalar::all(.5));
+    }
+
+    cv::Point2f position() const override {
+        return { _kalman.statePost.at<float>(0), _kalman.statePost.at<float>(1) };
+    }
+
+    cv::Point2f velocity() const override {
+        return { _kalman.statePost.at<float>(2), _kalman.statePost.at<float>(3) };
+    }
+
+private:
+    cv::KalmanFilter _kalman;
+};
+
+inline std::unique_ptr<PositionFilter> makePositionFilter(PositionFilterKind kind)
+{
+    switch (kind) {
+    case PositionFilterKind::OneEuro:
+        return std::unique_ptr<PositionFilter>(new OneEuroPositionFilter());
+    case PositionFilterKind::OpenCvKalman:
+        return std::unique_ptr<PositionFilter>(new OpenCvKalmanPositionFilter());
+    case PositionFilterKind::Kalman:
+    default:
+        return std::unique_ptr<PositionFilter>(new KalmanPositionFilter());
+    }
+}
+
+#endif
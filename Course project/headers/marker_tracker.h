@@ -0,0 +1,201 @@
+#ifndef _ARKANOID_MARKER_TRACKER_H_
+#define _ARKANOID_MARKER_TRACKER_H_
+
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+
+#include "marker_filter.h"
+
+struct TrackedMarker
+{
+    bool alive;
+    cv::Point2f position;
+    cv::Point2f velocity;       // per frame
+};
+
+/*
+ * Keeps up to MAX_TRACKS markers alive across frames, each with its own
+ * PositionFilter, in normalized [0, 1] frame coordinates.
+ *
+ * Every frame the candidate points (one per contour or blob) are matched to
+ * the tracks' predictions greedily, closest pair first, within a gating
+ * distance. A track keeps its slot for as long as it lives, so slot N can
+ * drive player N. A new track starts at rest where its candidate is; filters
+ * are only allocated the first time a slot is used.
+ *
+ * A leftover candidate within the gate of a live track does not start one:
+ * a frame difference often splits one marker into several contours (the
+ * leading and trailing edges), and those must not become a second player.
+ */
+class MarkerTracker
+{
+public:
+    static constexpr size_t MAX_TRACKS = 4;
+    static constexpr size_t MAX_CANDIDATES = 16;
+
+    typedef std::array<cv::Point2f, MAX_CANDIDATES> Candidates;
+    typedef std::array<TrackedMarker, MAX_TRACKS> Markers;
+
+    MarkerTracker(PositionFilterKind filter = PositionFilterKind::Kalman,
+                  float gate = 0.15f,
+                  int max_misses = 10):
+        _filter_kind(filter),
+        _gate(gate),
+        _max_misses(max_misses)
+    {
+        for (Track& track: _tracks) {
+            track.alive = false;
+            track.misses = 0;
+        }
+    }
+
+    // takes effect for tracks born from now on
+    void setFilter(PositionFilterKind kind) {
+        _filter_kind = kind;
+    }
+
+    // `count` candidates beyond MAX_CANDIDATES are ignored; only the first
+    // `tracks` slots are used
+    void update(const Candidates& candidates,
+                size_t count,
+                size_t tracks) {
+        count = std::min(count, (size_t)MAX_CANDIDATES);
+        tracks = std::min(tracks, (size_t)MAX_TRACKS);
+
+        std::array<cv::Point2f, MAX_TRACKS> predictions;
+        for (size_t t = 0; t < tracks; ++t) {
+            if (_tracks[t].alive) {
+                predictions[t] = _tracks[t].filter->predict();
+            }
+        }
+
+        // every track/candidate pair within the gate, closest first
+        std::array<Pair, MAX_TRACKS * MAX_CANDIDATES> pairs;
+        size_t pair_count = 0;
+        for (size_t t = 0; t < tracks; ++t) {
+            if (!_tracks[t].alive) {
+                continue;
+            }
+            for (size_t c = 0; c < count; ++c) {
+                cv::Point2f d = candidates[c] - predictions[t];
+                float distance2 = d.x * d.x + d.y * d.y;
+                if (distance2 <= _gate * _gate) {
+                    pairs[pair_count++] = { distance2, (uint8_t)t, (uint8_t)c };
+                }
+            }
+        }
+        std::sort(pairs.begin(), pairs.begin() + pair_count);
+
+        std::array<bool, MAX_TRACKS> track_taken = {};
+        std::array<bool, MAX_CANDIDATES> candidate_taken = {};
+        for (size_t i = 0; i < pair_count; ++i) {
+            const Pair& pair = pairs[i];
+            if (track_taken[pair.track] || candidate_taken[pair.candidate]) {
+                continue;
+            }
+
+            track_taken[pair.track] = true;
+            candidate_taken[pair.candidate] = true;
+            _tracks[pair.track].filter->correct(candidates[pair.candidate]);
+            _tracks[pair.track].misses = 0;
+        }
+
+        for (size_t t = 0; t < tracks; ++t) {
+            Track& track = _tracks[t];
+            if (track.alive && !track_taken[t] && ++track.misses > _max_misses) {
+                track.alive = false;
+            }
+        }
+
+        // leftover candidates away from every live track, including the ones
+        // born here, start tracks in free slots
+        size_t c = 0;
+        for (size_t t = 0; t < tracks; ++t) {
+            if (_tracks[t].alive) {
+                continue;
+            }
+            while (c < count && (candidate_taken[c] || nearLiveTrack(candidates[c], tracks))) {
+                ++c;
+            }
+            if (c == count) {
+                break;
+            }
+
+            Track& track = _tracks[t];
+            if (!track.filter || track.filter_kind != _filter_kind) {
+                track.filter = makePositionFilter(_filter_kind);
+                track.filter_kind = _filter_kind;
+            }
+            track.filter->reset(candidates[c]);
+            track.alive = true;
+            track.misses = 0;
+            candidate_taken[c] = true;
+        }
+
+        for (size_t t = tracks; t < MAX_TRACKS; ++t) {
+            _tracks[t].alive = false;
+        }
+    }
+
+    // per slot, scaled to `image_size`
+    Markers markers(const cv::Point2i& image_size) const {
+        Markers ret;
+        for (size_t t = 0; t < MAX_TRACKS; ++t) {
+            const Track& track = _tracks[t];
+            ret[t].alive = track.alive;
+            if (!track.alive) {
+                ret[t].position = ret[t].velocity = { 0.0f, 0.0f };
+                continue;
+            }
+
+            cv::Point2f position = track.filter->position();
+            cv::Point2f velocity = track.filter->velocity();
+            ret[t].position = { position.x * image_size.x, position.y * image_size.y };
+            ret[t].velocity = { velocity.x * image_size.x, velocity.y * image_size.y };
+        }
+        return ret;
+    }
+
+private:
+    bool nearLiveTrack(const cv::Point2f& candidate,
+                       size_t tracks) const {
+        for (size_t t = 0; t < tracks; ++t) {
+            if (_tracks[t].alive) {
+                cv::Point2f d = candidate - _tracks[t].filter->position();
+                if (d.x * d.x + d.y * d.y <= _gate * _gate) {
+                    return true;
+                }
+            }
+        }
+        return false;
+    }
+
+    struct Track
+    {
+        std::unique_ptr<PositionFilter> filter;
+        PositionFilterKind filter_kind;
+        bool alive;
+        int misses;
+    };
+
+    struct Pair
+    {
+        float distance2;
+        uint8_t track;
+        uint8_t candidate;
+
+        bool operator <(const Pair& other) const {
+            return distance2 < other.distance2;
+        }
+    };
+
+    PositionFilterKind _filter_kind;
+    float _gate;
+    int _max_misses;
+    std::array<Track, MAX_TRACKS> _tracks;
+};
+
+#endif
@@ -1,23 +1,43 @@
 #ifndef _ARKANOID_MESSAGE_QUEUE_H_
 #define _ARKANOID_MESSAGE_QUEUE_H_
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
 #include <mutex>
 #include <queue>
 
+#ifndef ARKANOID_CACHE_LINE_SIZE
+#define ARKANOID_CACHE_LINE_SIZE 64
+#endif
+
+enum class overflow_policy
+{
+    drop_newest,    // keep what is queued, discard the incoming element
+    drop_oldest,    // make room by discarding the element at the front
+};
 
 template<typename T>
 class message_queue
 {
 public:
-    explicit message_queue(size_t size_limit):
-        _size_limit(size_limit)
+    explicit message_queue(size_t size_limit,
+                           overflow_policy policy = overflow_policy::drop_newest):
+        _size_limit(size_limit),
+        _policy(policy),
+        _overwritten(0)
     {}
 
     void try_push(T&& elem) {
         std::lock_guard<decltype(_mutex)> lock(_mutex);
 
         if (_queue.size() >= _size_limit) {
-            return;
+            ++_overwritten;
+            if (_policy == overflow_policy::drop_newest) {
+                return;
+            }
+            _queue.pop();
         }
 
         _queue.push(std::forward<T>(elem));
@@ -35,10 +55,230 @@ public:
         return true;
     }
 
+    // number of elements discarded because the queue was full
+    size_t overwritten() {
+        std::lock_guard<decltype(_mutex)> lock(_mutex);
+        return _overwritten;
+    }
+
 private:
     std::mutex _mutex;
     std::queue<T> _queue;
     size_t _size_limit;
+    overflow_policy _policy;
+    size_t _overwritten;
+};
+
+/*
+ * Latest-value mailbox for one producer and one consumer.
+ *
+ * The producer always writes into its own back slot and publishes it by
+ * swapping it with the shared middle slot; the consumer swaps its front slot
+ * with the middle one only when a fresh value is there. Neither side ever
+ * waits, and the consumer always gets the newest value: anything published
+ * but not yet picked up is overwritten and counted.
+ */
+template<typename T>
+class triple_buffer
+{
+public:
+    triple_buffer():
+        _back(0),
+        _front(1),
+        _middle(2),
+        _overwritten(0)
+    {}
+
+    triple_buffer(const triple_buffer&) = delete;
+    triple_buffer& operator =(const triple_buffer&) = delete;
+
+    // producer side
+    void push(T&& elem) {
+        _slots[_back] = std::move(elem);
+
+        unsigned prev = _middle.exchange(_back | FRESH, std::memory_order_acq_rel);
+        if (prev & FRESH) {
+            _overwritten.fetch_add(1, std::memory_order_relaxed);
+        }
+        _back = prev & INDEX_MASK;
+    }
+
+    // consumer side
+    bool try_pop(T& out) {
+        if (!(_middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+
+        unsigned prev = _middle.exchange(_front, std::memory_order_acq_rel);
+        _front = prev & INDEX_MASK;
+
+        out = std::move(_slots[_front]);
+        return true;
+    }
+
+    // number of values replaced before the consumer picked them up
+    size_t overwritten() const {
+        return _overwritten.load(std::memory_order_relaxed);
+    }
+
+private:
+    static constexpr unsigned INDEX_MASK = 0x3;
+    static constexpr unsigned FRESH = 0x4;
+
+    T _slots[3];
+
+    alignas(ARKANOID_CACHE_LINE_SIZE) unsigned _back;
+    alignas(ARKANOID_CACHE_LINE_SIZE) unsigned _front;
+    alignas(ARKANOID_CACHE_LINE_SIZE) std::atomic<unsigned> _middle;
+    std::atomic<size_t> _overwritten;
+};
+
+/*
+ * Bounded ring for exactly one producer thread and one consumer thread.
+ *
+ * Push and pop are lock-free: each side owns one index and only reads the
+ * other one, so head and tail live on separate cache lines. The mutex and
+ * condition variables are touched only when one side has gone to sleep in
+ * pop_wait() or push_wait() and the other side has to wake it up.
+ */
+template<typename T>
+class spsc_queue
+{
+public:
+    explicit spsc_queue(size_t capacity):
+        _capacity(capacity),
+        _slots(new T[capacity]),
+        _head(0),
+        _tail_cache(0),
+        _tail(0),
+        _head_cache(0),
+        _consumer_waiting(false),
+        _producer_waiting(false)
+    {}
+
+    spsc_queue(const spsc_queue&) = delete;
+    spsc_queue& operator =(const spsc_queue&) = delete;
+
+    // producer side
+    bool try_push(T&& elem) {
+        const size_t tail = _tail.load(std::memory_order_relaxed);
+
+        if (tail - _head_cache >= _capacity) {
+            _head_cache = _head.load(std::memory_order_acquire);
+            if (tail - _head_cache >= _capacity) {
+                return false;
+            }
+        }
+
+        _slots[tail % _capacity] = std::move(elem);
+        _tail.store(tail + 1, std::memory_order_release);
+
+        wake_consumer();
+        return true;
+    }
+
+    // blocks while the queue is full; gives the element back untouched on timeout
+    template<typename Rep, typename Period>
+    bool push_wait(T&& elem,
+                   const std::chrono::duration<Rep, Period>& timeout) {
+        if (try_push(std::move(elem))) {
+            return true;
+        }
+
+        {
+            std::unique_lock<decltype(_mutex)> lock(_mutex);
+            _producer_waiting.store(true, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            _not_full.wait_for(lock, timeout, [this] {
+                return _tail.load(std::memory_order_relaxed)
+                       - _head.load(std::memory_order_acquire) < _capacity;
+            });
+            _producer_waiting.store(false, std::memory_order_relaxed);
+        }
+
+        return try_push(std::move(elem));
+    }
+
+    // consumer side
+    bool try_pop(T& out) {
+        const size_t head = _head.load(std::memory_order_relaxed);
+
+        if (head == _tail_cache) {
+            _tail_cache = _tail.load(std::memory_order_acquire);
+            if (head == _tail_cache) {
+                return false;
+            }
+        }
+
+        out = std::move(_slots[head % _capacity]);
+        _head.store(head + 1, std::memory_order_release);
+
+        wake_producer();
+        return true;
+    }
+
+    template<typename Rep, typename Period>
+    bool pop_wait(T& out,
+                  const std::chrono::duration<Rep, Period>& timeout) {
+        if (try_pop(out)) {
+            return true;
+        }
+
+        {
+            std::unique_lock<decltype(_mutex)> lock(_mutex);
+            _consumer_waiting.store(true, std::memory_order_relaxed);
+            // pairs with the fence in wake_consumer(): either we see the new
+            // tail here, or the producer sees _consumer_waiting and notifies
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+
+            _not_empty.wait_for(lock, timeout, [this] {
+                return _tail.load(std::memory_order_acquire)
+                       != _head.load(std::memory_order_relaxed);
+            });
+            _consumer_waiting.store(false, std::memory_order_relaxed);
+        }
+
+        return try_pop(out);
+    }
+
+    size_t capacity() const {
+        return _capacity;
+    }
+
+private:
+    void wake_consumer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_consumer_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<decltype(_mutex)> lock(_mutex);
+            _not_empty.notify_one();
+        }
+    }
+
+    void wake_producer() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (_producer_waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<decltype(_mutex)> lock(_mutex);
+            _not_full.notify_one();
+        }
+    }
+
+    const size_t _capacity;
+    std::unique_ptr<T[]> _slots;
+
+    // written by the consumer
+    alignas(ARKANOID_CACHE_LINE_SIZE) std::atomic<size_t> _head;
+    size_t _tail_cache;
+
+    // written by the producer
+    alignas(ARKANOID_CACHE_LINE_SIZE) std::atomic<size_t> _tail;
+    size_t _head_cache;
+
+    alignas(ARKANOID_CACHE_LINE_SIZE) std::atomic<bool> _consumer_waiting;
+    std::atomic<bool> _producer_waiting;
+    std::mutex _mutex;
+    std::condition_variable _not_empty;
+    std::condition_variable _not_full;
 };
 
 #endif
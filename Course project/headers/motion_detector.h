@@ -4,6 +4,12 @@
 #include <opencv2/opencv.hpp>
 
 #include <image.h>
+#include "change_map.h"
+#include "flow_tracker.h"
+#include "frame_arena.h"
+#include "image_kernels.h"
+#include "marker_filter.h"
+#include "marker_tracker.h"
 #include "window.h"
 
 template<size_t N, size_t I, typename T, typename... Tail>
@@ -52,18 +58,32 @@ namespace {
     }
 }
 
+// marker position in board coordinates and the frame it was detected in
+struct MarkerSample
+{
+    cv::Point2f position;
+    cv::Point2f velocity;       // board pixels per second
+    FrameStamp stamp;
+
+    // per tracker slot with max_markers above 1, velocities per second too
+    MarkerTracker::Markers markers;
+};
+
 class Marker
 {
 public:
-    Marker():
+    explicit Marker(PositionFilterKind filter = PositionFilterKind::Kalman):
         _grip(false),
-        _kalman(4, 2, 0)
-    {
-        _kalman.statePre = cv::Mat::zeros(2, 1, CV_32F);
-        cv::setIdentity(_kalman.measurementMatrix);
-        cv::setIdentity(_kalman.processNoiseCov, cv::Scalar::all(1e-1));
-        cv::setIdentity(_kalman.measurementNoiseCov, cv::Scalar::all(10));
-        cv::setIdentity(_kalman.errorCovPost, cv::Scalar::all(.5));
+        _filter_kind(filter),
+        _filter(makePositionFilter(filter))
+    {}
+
+    // starts over with a fresh filter if `kind` is not the current one
+    void setFilter(PositionFilterKind kind) {
+        if (kind != _filter_kind) {
+            _filter_kind = kind;
+            _filter = makePositionFilter(kind);
+        }
     }
 
     void nextPosition(const cv::Point2f& pos,
@@ -78,14 +98,34 @@ public:
     }
 
     void update() {
-        _kalman.correct(cv::Mat(_last_position));
+        _filter->correct(_last_position);
     }
 
+    // steps the filter to the next frame
     cv::Point2f getSmoothedPosition(const cv::Point2i& image_size) const {
-        const cv::Mat& prediction = _kalman.predict(cv::Mat());
+        cv::Point2f prediction = _filter->predict();
+
+        return { prediction.x * image_size.x,
+                 prediction.y * image_size.y };
+    }
+
+    // filtered position `frames_ahead` frames after the last correction,
+    // from the filter's position and velocity; unlike getSmoothedPosition()
+    // it does not advance the filter
+    cv::Point2f getPredictedPosition(const cv::Point2i& image_size,
+                                     float frames_ahead) const {
+        cv::Point2f position = _filter->position() + _filter->velocity() * frames_ahead;
 
-        return { prediction.at<float>(0) * image_size.x,
-                 prediction.at<float>(1) * image_size.y };
+        return { position.x * image_size.x,
+                 position.y * image_size.y };
+    }
+
+    // change of the filtered position per frame
+    cv::Point2f getVelocity(const cv::Point2i& image_size) const {
+        cv::Point2f velocity = _filter->velocity();
+
+        return { velocity.x * image_size.x,
+                 velocity.y * image_size.y };
     }
 
     cv::Point2f getLastPosition(const cv::Point2i& image_size) const {
@@ -108,7 +148,15 @@ public:
 private:
     cv::Point2f _last_position;
     bool _grip;
-    mutable cv::KalmanFilter _kalman;
+    PositionFilterKind _filter_kind;
+    std::unique_ptr<PositionFilter> _filter;
+};
+
+enum class DetectionMode
+{
+    FrameDifference,    // motion mask of consecutive frames
+    OpticalFlow,        // FlowTracker, seeded from the motion mask
+    BackgroundModel,    // kernels::BackgroundModel, at a fraction of the resolution
 };
 
 class MotionDetector {
@@ -122,24 +170,137 @@ public:
 
     std::vector<std::vector<cv::Point>> _contours;
 
-    std::vector<std::vector<cv::Point>> getSignificantContours(const Image& greyscale_image) const {
+    std::vector<std::vector<cv::Point>> getSignificantContours(const Image& greyscale_image) {
+        return getSignificantContours(greyscale_image, greyscale_image.size(), cv::Point(0, 0));
+    }
+
+    // `greyscale_image` is the part at `offset` of a mask of `mask_size`;
+    // contours come out in the coordinates of the whole mask
+    std::vector<std::vector<cv::Point>> getSignificantContours(const Image& greyscale_image,
+                                                               const cv::Size& mask_size,
+                                                               const cv::Point& offset) {
         std::vector<std::vector<cv::Point>> significant_contours;
+        getSignificantContours(greyscale_image, mask_size, offset, significant_contours);
+        return significant_contours;
+    }
 
-        std::vector<std::vector<cv::Point>> contours;
-        std::vector<cv::Vec4i> hierarchy;
-        cv::findContours(greyscale_image, contours, hierarchy,
-                         cv::RETR_TREE, cv::CHAIN_APPROX_SIMPLE,
-                         cv::Point(0, 0));
+    // into `out`, whose point vectors are reused for the contours kept
+    void getSignificantContours(const Image& greyscale_image,
+                                const cv::Size& mask_size,
+                                const cv::Point& offset,
+                                std::vector<std::vector<cv::Point>>& out) {
+        out.resize(appendSignificantContours(greyscale_image, mask_size, offset, out, 0));
+    }
 
-        for (auto& contour: contours) {
-            cv::Mat contour_mat(contour);
+    // writes the contours kept over out[count] onwards, reusing the point
+    // vectors already there, and returns the new count; `out` is not shrunk
+    size_t appendSignificantContours(const Image& greyscale_image,
+                                     const cv::Size& mask_size,
+                                     const cv::Point& offset,
+                                     std::vector<std::vector<cv::Point>>& out,
+                                     size_t count) {
+        double min_area = minArea(mask_size);
+
+        // outer contours only: a hole in a moving marker is not another
+        // marker, and the hierarchy was never looked at
+        cv::findContours(greyscale_image, _raw_contours,
+                         cv::RETR_EXTERNAL, cv::CHAIN_APPROX_SIMPLE,
+                         offset);
+
+        for (const auto& contour: _raw_contours) {
+            if (fabs(cv::contourArea(contour, false)) >= min_area) {
+                if (count == out.size()) {
+                    out.emplace_back();
+                }
+                out[count++].assign(contour.begin(), contour.end());
+            }
+        }
+        return count;
+    }
 
-            if (fabs(cv::contourArea(contour_mat, false)) >= settings.min_poly_area) {
-                significant_contours.emplace_back(contour);
+    // one connected region of the motion mask, in mask coordinates
+    struct Blob
+    {
+        int area;
+        cv::Point2d centroid;
+        cv::Rect bounding_box;
+    };
+
+    // same filtering as getSignificantContours(), from a single labelling
+    // pass; no point lists are built
+    std::vector<Blob> getSignificantBlobs(const Image& greyscale_image) {
+        return getSignificantBlobs(greyscale_image, greyscale_image.size(), cv::Point(0, 0));
+    }
+
+    std::vector<Blob> getSignificantBlobs(const Image& greyscale_image,
+                                          const cv::Size& mask_size,
+                                          const cv::Point& offset) {
+        std::vector<Blob> blobs;
+
+        double min_area = minArea(mask_size);
+
+        int labels = cv::connectedComponentsWithStats(greyscale_image, _labels, _label_stats,
+                                                      _label_centroids, 8, CV_32S);
+
+        // label 0 is the background
+        for (int label = 1; label < labels; ++label) {
+            const int* stats = _label_stats.ptr<int>(label);
+            if (stats[cv::CC_STAT_AREA] < min_area) {
+                continue;
             }
+
+            const double* centroid = _label_centroids.ptr<double>(label);
+            blobs.push_back({ stats[cv::CC_STAT_AREA],
+                              { centroid[0] + offset.x, centroid[1] + offset.y },
+                              { stats[cv::CC_STAT_LEFT] + offset.x, stats[cv::CC_STAT_TOP] + offset.y,
+                                stats[cv::CC_STAT_WIDTH], stats[cv::CC_STAT_HEIGHT] } });
         }
 
-        return significant_contours;
+        return blobs;
+    }
+
+    // geometry derived from the current frame's contours or blobs, built
+    // once per frame by integrate(); board coordinates
+    struct FrameAnalysis
+    {
+        struct Circle
+        {
+            cv::Point2f center;
+            float radius;
+        };
+
+        std::vector<std::vector<cv::Point>> polygons;   // approxPolyDP'd contours
+        std::vector<Circle> circles;                    // one per polygon
+        std::vector<cv::Rect> bounding_boxes;           // polygons first, then blobs
+        cv::Rect enclosing_rect;
+
+        // straight into the caller's board-sized image
+        void drawOnto(Image& out_image) const {
+            cv::Scalar color = cv::Scalar(163,163,163);
+
+            for (size_t i = 0; i < polygons.size(); ++i) {
+                cv::drawContours(out_image, polygons, (int) i, color,
+                                 1, 8, std::vector<cv::Vec4i>(), 0,
+                                 cv::Point());
+            }
+
+            for (const cv::Rect& bb: bounding_boxes) {
+                cv::rectangle(out_image, bb.tl(), bb.br(), color, 2, 8, 0);
+            }
+
+            cv::rectangle(out_image, enclosing_rect.tl(), enclosing_rect.br(),
+                          cv::Scalar(0, 255, 0), 2, 8, 0);
+        }
+    };
+
+    const FrameAnalysis& analysis() const {
+        return _analysis;
+    }
+
+    // share of the frame the mask and contour stages ran over last frame;
+    // below 1 only with skip_static_tiles or track_window
+    double activeTileRatio() const {
+        return _active_tile_ratio;
     }
 
     cv::Rect _prev_enclosing_rect;
@@ -154,8 +315,27 @@ public:
         }
     }
 
+    // tracked markers per slot, in board pixels (velocity per processed
+    // frame); all dead unless settings.max_markers is above 1
+    MarkerTracker::Markers getMarkerPositions() const
+    {
+        return _tracker.markers({ (int)width, (int)height });
+    }
+
+    // whether the last frame's detection found the marker
+    bool markerFound() const
+    {
+        return _window_misses == 0 && _window_lock;
+    }
+
+    // filtered marker velocity in board pixels per processed frame
+    cv::Point2f getMarkerVelocity() const
+    {
+        return _marker.getVelocity({ (int)width, (int)height });
+    }
+
     void detectGrip(const cv::Point& marker_pos) {
-        cv::Rect enclosing_rect = findEnclosingRect();
+        const cv::Rect& enclosing_rect = _analysis.enclosing_rect;
         if (_prev_enclosing_rect.contains(marker_pos)
                 || enclosing_rect.contains(marker_pos)) {
             int area = enclosing_rect.area() / 10000;
@@ -185,86 +365,355 @@ public:
         _prev_enclosing_rect = enclosing_rect;
     }
 
-  void nextFrame(const Image &frame) {
+    // everything extracted from one pair of consecutive frames; depends only
+    // on the frames and the settings, not on the detector's tracking state
+    struct Detection
+    {
+        Image frame;        // preprocessed current frame
+        Image source;       // camera frame it came from, if the caller kept it
+        cv::Size mask_size;
+        std::vector<std::vector<cv::Point>> contours;
+        std::vector<Blob> blobs;        // instead of contours with connected_components
+        double active_tile_ratio;       // share of the frame the mask was computed for
+    };
 
-        _prev_frame = std::move(_curr_frame);
-        _curr_frame = preprocessFrame(frame);
+    // not const: the fused motion kernel keeps its scratch in the detector
+    Detection detectMotion(const Image &prev_frame,
+                           const Image &curr_frame) {
+        return detectMotion(prev_frame, curr_frame,
+                            cv::Rect(0, 0, curr_frame.cols, curr_frame.rows));
+    }
 
-        if (!_curr_frame.empty() && !_prev_frame.empty()) {
-            Image preprocessed = amplifyMotion(_prev_frame, _curr_frame);
+    // looks for motion only inside `search_window`, in frame coordinates
+    Detection detectMotion(const Image &prev_frame,
+                           const Image &curr_frame,
+                           const cv::Rect &search_window) {
+        // nothing the previous call took from the arena is alive any more
+        if (_arena) {
+            _arena->reset();
+        }
 
-            _contours = getSignificantContours(preprocessed.toGreyscale());
+        Detection detection;
+        detection.frame = curr_frame;
+        detection.mask_size = curr_frame.size();
+        detection.active_tile_ratio = 0.0;
 
-            cv::Point marker_pos = _marker.getSmoothedPosition(frame.size());
-            if (!_contours.empty()) {
-                detectGrip(marker_pos);
+        cv::Rect roi = search_window & cv::Rect(0, 0, curr_frame.cols, curr_frame.rows);
+        if (roi.area() == 0) {
+            return detection;
+        }
+
+        // static tiles cannot contain motion; everything below only looks
+        // at the groups of changed ones
+        _regions.clear();
+        if (settings.skip_static_tiles) {
+            for (const cv::Rect& changed: _change_map.update(Image(prev_frame(roi)), Image(curr_frame(roi)))) {
+                _regions.push_back(changed + roi.tl());
             }
+        } else {
+            _regions.push_back(roi);
+        }
 
-            cv::Point2f center;
-            if (tryGetCenterPoint(_contours, center)) {
-                _marker.nextPosition(center, preprocessed.size());
+        // contours given back with recycleContours(), overwritten in place
+        detection.contours.swap(_spare_contours);
+        size_t contours = 0;
+
+        for (const cv::Rect& region: _regions) {
+            detection.active_tile_ratio += (double)region.area() / curr_frame.total();
+
+            Image mask = amplifyMotion(Image(prev_frame(region)), Image(curr_frame(region)),
+                                       curr_frame.size());
+            if (mask.empty()) {
+                continue;
+            }
+            if (settings.connected_components) {
+                std::vector<Blob> blobs = getSignificantBlobs(mask, detection.mask_size, region.tl());
+                detection.blobs.insert(detection.blobs.end(), blobs.begin(), blobs.end());
             } else {
-                _marker.update();
+                contours = appendSignificantContours(mask, detection.mask_size, region.tl(),
+                                                     detection.contours, contours);
             }
-
-            std::move(preprocessed);
         }
+        detection.contours.resize(contours);
+
+        return detection;
     }
 
-    Image toImage(const Image &background) const {
-        Image ret = static_cast<Image>(Image::zeros(height, width, CV_8UC3));
+    // sequential half of nextFrame(): detections must come in capture order.
+    // Takes the detection's results and leaves the previous frame's contours
+    // in detection.contours, for recycleContours()
+    void integrate(Detection& detection) {
+        _marker.setFilter(settings.marker_filter);
+
+        _curr_frame = std::move(detection.frame);
+        _mask_size = detection.mask_size;
+        _contours.swap(detection.contours);
+        _blobs = std::move(detection.blobs);
+        _active_tile_ratio = detection.active_tile_ratio;
+        analyze();
+
+        cv::Point marker_pos = _marker.getSmoothedPosition({ (int)width, (int)height });
+        if (!_contours.empty() || !_blobs.empty()) {
+            detectGrip(marker_pos);
+        }
+
+        if (settings.max_markers > 1) {
+            trackMarkers();
+        }
+
+        cv::Point2f center;
+        if (tryGetCenterPoint(_contours, center) || tryGetCenterPoint(_blobs, center)) {
+            _marker.nextPosition(center, _mask_size);
+
+            _window_lock = true;
+            _window_misses = 0;
+            _marker_extent = _analysis.enclosing_rect.size();
+        } else {
+            _marker.update();
+
+            if (_window_lock && ++_window_misses > settings.window_max_misses) {
+                _window_lock = false;
+            }
+        }
+    }
 
-        bool show_bg = settings.show_background;
+    // contour vectors the next detectMotion() writes over instead of
+    // allocating its own; `contours` gets the ones held so far
+    void recycleContours(std::vector<std::vector<cv::Point>>& contours) {
+        _spare_contours.swap(contours);
+    }
 
-        if (!_curr_frame.empty() && settings.show_debug_frame) {
-            ret += _curr_frame.resized(ret.size());
+    // where nextFrame() looks for the marker in the next frame, in the
+    // coordinates of a frame of `frame_size`: a box around the predicted
+    // position a few times the marker's size, widening with every miss.
+    // The whole frame while there is no lock
+    cv::Rect searchWindow(const cv::Size& frame_size) const {
+        cv::Rect frame_rect(0, 0, frame_size.width, frame_size.height);
+        if (!settings.track_window || !_window_lock) {
+            return frame_rect;
         }
 
+        const float WINDOW_SCALE = 2.0f;
+        const float MIN_HALF_SIZE = 48.0f;
+        const float MISS_GROWTH = 1.5f;
+
+        cv::Point2f center = _marker.getPredictedPosition({ (int)width, (int)height }, 1.0f);
+        float growth = std::pow(MISS_GROWTH, (float)_window_misses);
+        cv::Point2f half(std::max(_marker_extent.width * WINDOW_SCALE / 2, MIN_HALF_SIZE) * growth,
+                         std::max(_marker_extent.height * WINDOW_SCALE / 2, MIN_HALF_SIZE) * growth);
+
+        cv::Point2f scale((float)frame_size.width / width,
+                          (float)frame_size.height / height);
+        cv::Rect window((int)((center.x - half.x) * scale.x), (int)((center.y - half.y) * scale.y),
+                        (int)(2 * half.x * scale.x), (int)(2 * half.y * scale.y));
+        return window & frame_rect;
+    }
+
+  void nextFrame(const Image &frame) {
 
-        if (!background.empty() && show_bg) {
-            ret += background.resized(ret.size());
+        const Image& level = toPyramidLevel(frame);
+
+        // the frame before last is not needed any more; its buffer takes
+        // the new one
+        std::swap(_prev_frame, _curr_frame);
+        preprocessLevel(level, _curr_frame);
+
+        if (settings.mode == DetectionMode::OpticalFlow) {
+            std::swap(_prev_grey, _curr_grey);
+            cv::cvtColor(level, _curr_grey, cv::COLOR_BGR2GRAY);
         }
 
-        drawDebugInfo(ret);
+        if (!_curr_frame.empty() && !_prev_frame.empty()) {
+            Detection detection;
+            if (settings.mode == DetectionMode::OpticalFlow) {
+                detection = detectFlow();
+            } else if (settings.mode == DetectionMode::BackgroundModel) {
+                detection = detectBackground();
+            } else {
+                detection = detectMotion(_prev_frame, _curr_frame, searchWindow(_curr_frame.size()));
+            }
 
-        settings.display(ret);
+            integrate(detection);
+            recycleContours(detection.contours);
+        }
+    }
+
+    Image toImage(const Image &background) const {
+        Image ret;
+        toImage(background, ret);
         return ret;
     }
 
+    // renders into `ret`, reusing its buffer if it already has the right geometry
+    void toImage(const Image &background, Image &ret) const {
+        ret.create((int)height, (int)width, CV_8UC3);
+
+        compose(background, settings.show_background,
+                settings.show_debug_frame ? _curr_frame : Image(), ret);
+        if (settings.show_debug_contours) {
+            _analysis.drawOnto(ret);
+        }
+    }
+
+    // the debug layers of one frame, detached from the detector so the
+    // display can render them later, and only if it shows that frame
+    struct Overlay
+    {
+        FrameAnalysis analysis;     // drawn if show_contours
+        Image frame;                // preprocessed frame, if show_debug_frame
+        cv::Size board_size;
+        bool show_background = true;
+        bool show_contours = false;
+
+        // `out` gets the board's geometry; its buffer is reused if it has it
+        void render(const Image& background,
+                    Image& out) const {
+            out.create(board_size, CV_8UC3);
+            compose(background, show_background, frame, out);
+            if (show_contours) {
+                analysis.drawOnto(out);
+            }
+        }
+    };
+
+    // everything enabled in settings, or a no-op when there is nothing to
+    // draw; `out` keeps its buffers between calls
+    void overlay(Overlay& out) const {
+        out.board_size = { (int)width, (int)height };
+        out.show_background = settings.show_background;
+        out.show_contours = settings.show_debug_contours;
+
+        if (out.show_contours) {
+            out.analysis = _analysis;
+        }
+        // a copy: nextFrame() reuses the buffer two frames later
+        if (settings.show_debug_frame) {
+            _curr_frame.copyTo(out.frame);
+        } else {
+            out.frame = Image();
+        }
+    }
+
     struct Settings {
+        // preprocessFrame() keeps the pixels within marker_colour_tolerance
+        // of marker_colour (B, G, R) in every channel
+        cv::Scalar marker_colour = cv::Scalar(0, 0, 0);
+        int marker_colour_tolerance = 40;
+
         uint8_t motion_threshold = 100;
       int min_poly_area = 300;
         bool show_background = true;
         bool show_debug_contours = true;
         bool show_debug_frame = false;
 
-        void display(Image &image) const {
-            Image textImage(image.size(), image.type(), cv::Scalar(0, 0, 0, 255));
-        }
+        // kernels::MotionMask instead of the chain of OpenCV calls
+        bool fused_motion_kernel = true;
+
+        // extract the marker with connectedComponentsWithStats instead of
+        // findContours; the centre is then area-weighted
+        bool connected_components = false;
+
+        // detect on the frame pyrDown'ed this many times; 0 works on the full
+        // frame and resamples the motion mask to 320x240 and back instead
+        int pyramid_level = 0;
+
+        // run the motion mask and contours only over the tiles that changed
+        // since the previous frame, plus a one-tile halo
+        bool skip_static_tiles = false;
+
+        // once the marker is found, look for it only in a window around its
+        // predicted position; after more than window_max_misses frames
+        // without it, scan the whole frame again. With DetectorPool the
+        // window comes with each submitted frame and lags the tracking by
+        // the frames the workers are ahead
+        bool track_window = false;
+        int window_max_misses = 5;
+
+        PositionFilterKind marker_filter = PositionFilterKind::Kalman;
+
+        // OpticalFlow and BackgroundModel only apply to nextFrame();
+        // DetectorPool's workers keep no state from one frame to the next,
+        // so the command lines refuse them together with workers
+        DetectionMode mode = DetectionMode::FrameDifference;
+
+        // BackgroundModel: one model pixel per background_step^2 pixels of
+        // the detection frame, learning rate 1/2^background_learning_shift
+        // per frame, foreground beyond background_threshold grey levels
+        int background_step = 4;
+        int background_learning_shift = 5;
+        int background_threshold = 30;
+
+        // above 1, also track that many markers separately, one per moving
+        // contour or blob, see getMarkerPositions()
+        size_t max_markers = 1;
     };
 
     Settings settings;
     size_t width;
     size_t height;
 
+    Image preprocessFrame(const Image &image)
+    {
+        return preprocessLevel(toPyramidLevel(image));
+    }
+
 private:
+    // preprocessFrame() of a frame already at settings.pyramid_level
+    Image preprocessLevel(const Image &level)
+    {
+        Image ret;
+        preprocessLevel(level, ret);
+        return ret;
+    }
+
+    void preprocessLevel(const Image &level,
+                         Image &out)
+    {
+        _colour_key.setKey(settings.marker_colour, settings.marker_colour_tolerance);
+        _colour_key.run(level, out);
+    }
+
     Image _prev_frame;
     Image _curr_frame;
+    cv::Size _mask_size;
 
     Marker _marker;
 
-    cv::Scalar _significant_color = cv::Scalar(0, 0, 0);
+    kernels::MotionMask _motion_mask;
+    kernels::BoxBlur _box_blur;         // with fused_motion_kernel off
+    Image _small_mask;
+    Image _mask;
+    std::vector<Image> _pyramid;
 
-    Image preprocessFrame(const Image &image)
-    {
-        float THRESHOLD = 40;
+    std::vector<Blob> _blobs;
+    FrameAnalysis _analysis;
 
-        Image ret(image.size(), image.type());
-        cv::absdiff(image, _significant_color, ret);
-        cv::threshold(ret, ret, THRESHOLD, 255, cv::THRESH_BINARY_INV);
+    ChangeMap _change_map;
+    double _active_tile_ratio = 1.0;
 
-        return ret;
-    }
+    MarkerTracker _tracker;
+
+    kernels::BackgroundModel _background;
+
+    FlowTracker _flow;
+    cv::Mat _prev_grey;             // camera frames at the pyramid level
+    cv::Mat _curr_grey;
+
+    bool _window_lock = false;
+    int _window_misses = 0;
+    cv::Size _marker_extent;        // board pixels, at the last hit
+    cv::Mat _labels;
+    cv::Mat _label_stats;
+    cv::Mat _label_centroids;
+
+    kernels::ColourKey _colour_key;
+
+    // the step-by-step motion mask's temporaries, created the first time
+    // it runs; held by pointer so the detector stays movable
+    std::unique_ptr<FrameArena> _arena;
+    std::vector<std::vector<cv::Point>> _raw_contours;
+    std::vector<cv::Rect> _regions;             // the parts of the frame detectMotion() looks at
+    std::vector<std::vector<cv::Point>> _spare_contours;
 
     static bool tryGetCenterPoint(const std::vector<std::vector<cv::Point>>& contours,
                                   cv::Point2f& out_point) {
@@ -290,117 +739,247 @@ private:
         return true;
     }
 
-    cv::Rect findEnclosingRect() const {
-        std::vector<cv::Rect> bounding_boxes;
+    static bool tryGetCenterPoint(const std::vector<Blob>& blobs,
+                                  cv::Point2f& out_point) {
+        if (blobs.empty()) {
+            return false;
+        }
+
+        cv::Point2d sum(0, 0);
+        double area = 0;
+        for (const Blob& blob: blobs) {
+            sum += blob.centroid * (double)blob.area;
+            area += blob.area;
+        }
+
+        out_point.x = (float)(sum.x / area);
+        out_point.y = (float)(sum.y / area);
+        return true;
+    }
+
+    cv::Rect toBoardRect(const cv::Rect& rect) const {
+        cv::Point2f scale((float)width / _mask_size.width,
+                          (float)height / _mask_size.height);
+
+        return { (int)(rect.x * scale.x), (int)(rect.y * scale.y),
+                 (int)(rect.width * scale.x), (int)(rect.height * scale.y) };
+    }
+
+    // fills _analysis from _contours / _blobs, in board coordinates
+    void analyze() {
+        FrameAnalysis& analysis = _analysis;
+        analysis.polygons.resize(_contours.size());
+        analysis.circles.resize(_contours.size());
+        analysis.bounding_boxes.clear();
+        analysis.enclosing_rect = cv::Rect();
 
-        cv::Rect big_bb;
-        cv::Point2f scale((float)width / _curr_frame.cols,
-                          (float)height / _curr_frame.rows);
-        for (const auto& contour: _contours) {
-            std::vector<cv::Point> poly;
-            cv::approxPolyDP(cv::Mat(contour), poly, 3, true);
+        cv::Point2f scale((float)width / _mask_size.width,
+                          (float)height / _mask_size.height);
+        for (size_t i = 0; i < _contours.size(); ++i) {
+            std::vector<cv::Point>& poly = analysis.polygons[i];
+            cv::approxPolyDP(_contours[i], poly, 3, true);
 
             for (cv::Point& p: poly) {
                 p.x *= scale.x;
                 p.y *= scale.y;
             }
 
-            cv::Mat poly_mat(poly);
-            cv::Rect bb = cv::boundingRect(poly_mat);
+            analysis.bounding_boxes.push_back(cv::boundingRect(poly));
+            cv::minEnclosingCircle(poly, analysis.circles[i].center, analysis.circles[i].radius);
+        }
 
-            if (big_bb.area() == 0) {
-                big_bb = bb;
+        for (const Blob& blob: _blobs) {
+            analysis.bounding_boxes.push_back(toBoardRect(blob.bounding_box));
+        }
+
+        for (const cv::Rect& bb: analysis.bounding_boxes) {
+            if (analysis.enclosing_rect.area() == 0) {
+                analysis.enclosing_rect = bb;
             } else {
-                big_bb = enclosingRect(big_bb, bb);
+                analysis.enclosing_rect = enclosingRect(analysis.enclosing_rect, bb);
             }
         }
+    }
 
-        return big_bb;
+    // sum of the camera frame and the preprocessed one, whichever are shown
+    static void compose(const Image& background,
+                        bool show_background,
+                        const Image& debug_frame,
+                        Image& out) {
+        if (show_background && !background.empty()) {
+            if (background.size() == out.size()) {
+                background.copyTo(out);
+            } else {
+                cv::resize(background, out, out.size());
+            }
+        } else {
+            out.setTo(cv::Scalar::all(0));
+        }
+
+        if (!debug_frame.empty()) {
+            out += debug_frame.toColored().resized(out.size());
+        }
     }
 
-    void drawDebugContours(Image& out_image) const {
-        std::vector<std::vector<cv::Point>> contours_poly;
-        std::vector<cv::Rect> bounding_boxes;
+    // `image` downsampled to settings.pyramid_level; the intermediate levels
+    // are kept between frames so their buffers get reused
+    const Image& toPyramidLevel(const Image& image) {
+        if (settings.pyramid_level <= 0) {
+            return image;
+        }
 
-        contours_poly.reserve(_contours.size());
-        bounding_boxes.reserve(_contours.size());
+        _pyramid.resize((size_t)settings.pyramid_level);
 
-        cv::Rect big_bb;
-        cv::Point2f scale((float)width / _curr_frame.cols,
-                          (float)height / _curr_frame.rows);
-        for (const auto& contour: _contours) {
-            std::vector<cv::Point> poly;
-            cv::approxPolyDP(cv::Mat(contour), poly, 3, true);
+        const Image* level = &image;
+        for (Image& next: _pyramid) {
+            cv::pyrDown(*level, next);
+            level = &next;
+        }
+        return *level;
+    }
 
-            for (cv::Point& p: poly) {
-                p.x *= scale.x;
-                p.y *= scale.y;
-            }
+    // DetectionMode::OpticalFlow: follows the flow points while they hold,
+    // otherwise finds the marker by frame differencing and seeds new points
+    // inside what was found. A tracked marker comes out as a single blob
+    Detection detectFlow() {
+        if (_flow.track(_prev_grey, _curr_grey)) {
+            Detection detection;
+            detection.frame = _curr_frame;
+            detection.mask_size = _curr_frame.size();
+
+            cv::Rect bounds = _flow.bounds();
+            cv::Point2f center = _flow.center();
+            detection.blobs.push_back({ std::max(1, bounds.area()), { center.x, center.y }, bounds });
+            detection.active_tile_ratio = std::min(1.0, (double)bounds.area() / _curr_frame.total());
+            return detection;
+        }
 
-            cv::Mat poly_mat(poly);
-            cv::Rect bb = cv::boundingRect(poly_mat);
+        Detection detection = detectMotion(_prev_frame, _curr_frame, searchWindow(_curr_frame.size()));
 
-            if (big_bb.area() == 0) {
-                big_bb = bb;
-            } else {
-                big_bb = enclosingRect(big_bb, bb);
-            }
+        cv::Rect region;
+        for (const std::vector<cv::Point>& contour: detection.contours) {
+            region |= cv::boundingRect(contour);
+        }
+        for (const Blob& blob: detection.blobs) {
+            region |= blob.bounding_box;
+        }
+        if (region.area() > 0) {
+            _flow.seed(_curr_grey, region);
+        }
 
-            cv::Point2f center;
-            float radius;
-            cv::minEnclosingCircle(poly_mat, center, radius);
+        return detection;
+    }
+
+    // DetectionMode::BackgroundModel: the current frame against the model,
+    // which learns it in the same pass
+    Detection detectBackground() {
+        Detection detection;
+        detection.frame = _curr_frame;
+        detection.active_tile_ratio = 1.0;
+
+        _background.run(_curr_frame, settings.background_step, settings.background_learning_shift,
+                        settings.background_threshold, _small_mask);
+        detection.mask_size = _background.size();
 
-            contours_poly.emplace_back(std::move(poly));
-            bounding_boxes.emplace_back(std::move(bb));
+        if (settings.connected_components) {
+            detection.blobs = getSignificantBlobs(_small_mask);
+        } else {
+            detection.contours = getSignificantContours(_small_mask);
         }
+        return detection;
+    }
 
-        if (settings.show_debug_contours) {
-            for (size_t i = 0; i < contours_poly.size(); ++i) {
-                cv::Scalar color = cv::Scalar(163,163,163);
-                cv::drawContours(out_image, contours_poly, (int) i, color,
-                                 1, 8, std::vector<cv::Vec4i>(), 0,
-                                 cv::Point());
-                cv::rectangle(out_image,
-                              bounding_boxes[i].tl(), bounding_boxes[i].br(),
-                              color, 2, 8, 0);
+    // one candidate per contour or blob, normalized like Marker positions
+    void trackMarkers() {
+        MarkerTracker::Candidates candidates;
+        size_t count = 0;
+
+        cv::Point2f scale(1.0f / _mask_size.width, 1.0f / _mask_size.height);
+        for (size_t i = 0; i < _contours.size() && count < candidates.size(); ++i) {
+            cv::Point2f center(0, 0);
+            for (const cv::Point& p: _contours[i]) {
+                center.x += p.x;
+                center.y += p.y;
             }
+            center *= 1.0f / _contours[i].size();
+            candidates[count++] = { center.x * scale.x, center.y * scale.y };
+        }
+        for (size_t i = 0; i < _blobs.size() && count < candidates.size(); ++i) {
+            candidates[count++] = { (float)_blobs[i].centroid.x * scale.x,
+                                    (float)_blobs[i].centroid.y * scale.y };
         }
-    }
 
-    void drawDebugInfo(Image& out_image) const {
-        if (settings.show_debug_contours) {
-            drawDebugContours(out_image);
+        _tracker.setFilter(settings.marker_filter);
+        _tracker.update(candidates, count, settings.max_markers);
+    }
 
-            cv::Rect enclosing_rect = findEnclosingRect();
-            cv::rectangle(out_image, enclosing_rect.tl(), enclosing_rect.br(),
-                          cv::Scalar(0, 255, 0), 2, 8, 0);
-        }
+    // min_poly_area is in board pixels, the mask may be smaller
+    double minArea(const cv::Size& mask_size) const {
+        return settings.min_poly_area * (double)mask_size.area() / ((double)width * height);
     }
 
+    // single channel mask of the moving parts of the frames, 0 or 255, the
+    // size of `curr_frame`; that may be a part of a frame of `frame_size`.
+    // An empty Image when nothing moved. The fused kernel's mask is only
+    // valid until the next call; the other one comes from the arena and has
+    // to be gone before the next detectMotion()
     Image amplifyMotion(const Image& prev_frame,
-                        const Image& curr_frame) {
-        cv::Size small_size(320, 240);
+                        const Image& curr_frame,
+                        const cv::Size& frame_size) {
+        const bool full_resolution = settings.pyramid_level <= 0;
+        cv::Size small_size = curr_frame.size();
+        if (full_resolution) {
+            small_size = { std::max(1, curr_frame.cols * 320 / frame_size.width),
+                           std::max(1, curr_frame.rows * 240 / frame_size.height) };
+        }
 
-        Image diff = static_cast<Image>(curr_frame - prev_frame);
+        if (settings.fused_motion_kernel) {
+            _motion_mask.run(prev_frame, curr_frame, small_size, 7,
+                             settings.motion_threshold, _small_mask);
+            if (cv::countNonZero(_small_mask) == 0) {
+                return Image();
+            }
+            if (!full_resolution) {
+                return _small_mask;
+            }
 
-        Image r, g, b;
-        std::tie(b, g, r) = unpack(diff.toChannels());
+            _mask.create(curr_frame.size(), CV_8UC1);
+            cv::resize(_small_mask, _mask, _mask.size(), 0, 0, cv::INTER_NEAREST);
+            return _mask;
+        }
 
-        for (Image* channel_ptr: { &r, &g, &b }) {
-            Image& channel = *channel_ptr;
-            channel = channel.resized(small_size);
-            cv::equalizeHist(channel, channel);
+        Image diff = arenaImage();
+        cv::subtract(curr_frame, prev_frame, diff);
+
+        Image greyscale = arenaImage();
+        diff.resized(small_size, greyscale);
+        cv::equalizeHist(greyscale, greyscale);
+        _box_blur.run(greyscale, greyscale, 7);
+
+        Image preprocessed = arenaImage();
+        cv::threshold(greyscale, preprocessed, settings.motion_threshold, 255, cv::THRESH_BINARY);
+        if (cv::countNonZero(preprocessed) == 0) {
+            return Image();
         }
 
-        Image rgb = Image::fromChannels(b, g, r);
+        if (!full_resolution) {
+            return preprocessed;
+        }
 
-        Image greyscale_big = rgb.toGreyscale();
-        Image greyscale = greyscale_big.resized(small_size);
+        Image resized = arenaImage();
+        preprocessed.resized(curr_frame.size(), resized);
+        return resized;
+    }
 
-        Image preprocessed;
-        cv::threshold(greyscale.blurred(7).toColored(), preprocessed, settings.motion_threshold, 255, cv::THRESH_BINARY);
+    // empty, but allocates from the arena once created
+    Image arenaImage() {
+        if (!_arena) {
+            _arena.reset(new FrameArena());
+        }
 
-        return preprocessed.resized(curr_frame.cols, curr_frame.rows);
+        Image ret;
+        ret.allocator = _arena.get();
+        return ret;
     }
 };
 
@@ -10,6 +10,9 @@ public:
     double getElapsedSeconds();
     unsigned long getElapsedNanos();
 
+    // monotonic clock shared by all threads, for stamping frames
+    static long long monotonicNanos();
+
 private:
     struct timespec _start_time;
 };
@@ -0,0 +1,922 @@
+#include <opencv2/opencv.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <mutex>
+#include <new>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <image.h>
+#include <timer.h>
+
+#include "motion_detector.h"
+#include "calibration.h"
+#include "detector_pool.h"
+#include "frame_source.h"
+#include "image_kernels.h"
+#include "marker_filter.h"
+#include "marker_tracker.h"
+
+/*
+ * Offline benchmarks; nothing here needs a camera.
+ *
+ * Every run feeds the same frames: either the deterministic synthetic scene
+ * or a recorded clip passed with --video.
+ */
+
+/*
+ * Heap allocation counters for --allocations: every operator new in the
+ * process, and every cv::Mat buffer, which OpenCV allocates with its own
+ * allocator rather than operator new.
+ */
+static std::atomic<size_t> heap_allocations(0);
+
+void* operator new(size_t size)
+{
+    ++heap_allocations;
+    if (void* ptr = std::malloc(size ? size : 1)) {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+class CountingMatAllocator: public cv::MatAllocator
+{
+public:
+    CountingMatAllocator():
+        allocations(0),
+        _std(cv::Mat::getStdAllocator())
+    {}
+
+    cv::UMatData* allocate(int dims,
+                           const int* sizes,
+                           int type,
+                           void* data,
+                           size_t* step,
+                           mat_access_flag flags,
+                           cv::UMatUsageFlags usage) const override {
+        if (!data) {
+            ++allocations;
+        }
+        return _std->allocate(dims, sizes, type, data, step, flags, usage);
+    }
+
+    bool allocate(cv::UMatData* data,
+                  mat_access_flag flags,
+                  cv::UMatUsageFlags usage) const override {
+        return _std->allocate(data, flags, usage);
+    }
+
+    void deallocate(cv::UMatData* data) const override {
+        _std->deallocate(data);
+    }
+
+    mutable std::atomic<size_t> allocations;
+
+private:
+    cv::MatAllocator* _std;
+};
+
+struct BenchSettings
+{
+    FrameSourceSettings source;
+    size_t frames = 600;
+    size_t workers = 0;
+    bool kernels = false;
+    bool extraction = false;
+    bool filters = false;
+    bool assignment = false;
+    bool allocations = false;
+    bool isa_levels = false;
+    MotionDetector::Settings detector;
+    cv::Size frame_size = { 1300, 720 };
+};
+
+static std::unique_ptr<FrameSource> openBenchSource(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openFrameSource(settings.source, settings.frame_size, 60);
+    if (!source->isOpened()) {
+        std::cerr << "cannot open frame source\n";
+        std::exit(1);
+    }
+    return source;
+}
+
+static void benchDetector(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+
+    cv::Size size = source->frameSize();
+    MotionDetector detector((size_t)size.width, (size_t)size.height);
+    detector.settings = settings.detector;
+
+    Image frame;
+    Timer timer;
+    double total_s = 0.0;
+    double worst_s = 0.0;
+    double active_tiles = 0.0;
+    size_t found = 0;
+    size_t frames = 0;
+
+    // tracking stability: how often the marker was found, and how much its
+    // position jerks around, as the mean second difference between frames
+    cv::Point2f positions[3];
+    double jitter = 0.0;
+    size_t jitter_samples = 0;
+
+    for (; frames < settings.frames; ++frames) {
+        if (!source->read(frame)) {
+            break;
+        }
+        frame.flip(Image::FlipAxis::Y);
+
+        timer.reset();
+        detector.nextFrame(frame);
+        double elapsed_s = timer.getElapsedSeconds();
+
+        total_s += elapsed_s;
+        worst_s = std::max(worst_s, elapsed_s);
+        active_tiles += detector.activeTileRatio();
+
+        if (detector.markerFound()) {
+            ++found;
+        }
+
+        positions[0] = positions[1];
+        positions[1] = positions[2];
+        positions[2] = detector.getMarkerPos();
+        if (frames >= 2) {
+            cv::Point2f jerk = positions[2] - positions[1] * 2.0f + positions[0];
+            jitter += std::sqrt(jerk.x * jerk.x + jerk.y * jerk.y);
+            ++jitter_samples;
+        }
+    }
+
+    const char* mode = settings.detector.mode == DetectionMode::OpticalFlow ? "optical flow"
+                       : settings.detector.mode == DetectionMode::BackgroundModel ? "background model"
+                       : "frame difference";
+
+    std::cout << "MotionDetector::nextFrame, " << mode << ", " << size.width << "x" << size.height
+              << ", pyramid level " << settings.detector.pyramid_level << ", " << frames << " frames: "
+              << (total_s > 0.0 ? frames / total_s : 0.0) << " fps, "
+              << (frames ? total_s * 1e3 / frames : 0.0) << " ms mean, "
+              << worst_s * 1e3 << " ms worst, "
+              << (frames ? active_tiles * 100.0 / frames : 0.0) << "% active tiles\n"
+              << "  marker found in " << (frames ? found * 100.0 / frames : 0.0) << "% of frames, "
+              << (jitter_samples ? jitter / jitter_samples : 0.0) << " px mean jitter\n";
+}
+
+// wall-clock throughput of the whole detector stage, including frame decode
+static void benchDetectorPool(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+
+    cv::Size size = source->frameSize();
+    MotionDetector detector((size_t)size.width, (size_t)size.height);
+    detector.settings = settings.detector;
+    size_t delivered = 0;
+
+    // the sink runs on the workers; the window it leaves is read here
+    std::mutex window_mutex;
+    cv::Rect window(cv::Point(0, 0), size);
+
+    long long start_ns = Timer::monotonicNanos();
+    size_t frames = 0;
+    {
+        DetectorPool pool(settings.workers, (size_t)size.width, (size_t)size.height,
+                          detector.settings,
+                          [&](MotionDetector::Detection& detection) {
+                              detector.integrate(detection);
+                              ++delivered;
+
+                              std::lock_guard<std::mutex> lock(window_mutex);
+                              window = detector.searchWindow(size);
+                          });
+
+        Image frame;
+        for (; frames < settings.frames; ++frames) {
+            if (!source->read(frame)) {
+                break;
+            }
+            frame.flip(Image::FlipAxis::Y);
+
+            cv::Rect search_window;
+            {
+                std::lock_guard<std::mutex> lock(window_mutex);
+                search_window = window;
+            }
+            pool.submit(frame, search_window, std::chrono::hours(1));
+            frame = Image();
+        }
+    }
+    double total_s = (Timer::monotonicNanos() - start_ns) / 1e9;
+
+    std::cout << "DetectorPool, " << settings.workers << " workers, "
+              << size.width << "x" << size.height << ", " << delivered << " frames: "
+              << (total_s > 0.0 ? delivered / total_s : 0.0) << " fps wall clock\n";
+}
+
+// scalar and vectorized kernels must agree bit for bit before either is timed
+static bool benchMotionKernels(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+
+    const cv::Size small_size(320, 240);
+    const kernels::Isa isas[] = { kernels::Isa::Scalar, kernels::bestIsa() };
+
+    kernels::MotionMask motion_masks[2];
+    kernels::BackgroundModel backgrounds[2];
+    Image masks[2];
+    Image background_masks[2];
+    double total_s[2] = { 0.0, 0.0 };
+    double background_s[2] = { 0.0, 0.0 };
+
+    // preprocessFrame()'s colour key against the absdiff + threshold it replaced
+    kernels::ColourKey colour_key;
+    colour_key.setKey(cv::Scalar(0, 0, 0), 40);
+    Image key_mask;
+    Image key_reference;
+    double key_s = 0.0;
+    double key_reference_s = 0.0;
+
+    // Image's one-pass channel split and merge against the per-channel
+    // OpenCV calls
+    std::array<Image, 3> channels;
+    Image interleaved;
+    std::array<Image, 3> extracted;
+    Image merged;
+    double split_s = 0.0;
+    double interleave_s = 0.0;
+    double extract_s = 0.0;
+    double insert_s = 0.0;
+
+    Image prev;
+    Image frame;
+    Timer timer;
+    size_t frames = 0;
+
+    for (; frames < settings.frames; ++frames) {
+        if (!source->read(frame)) {
+            break;
+        }
+
+        if (!prev.empty()) {
+            for (size_t i = 0; i < 2; ++i) {
+                timer.reset();
+                motion_masks[i].run(prev, frame, small_size, 7, 100, masks[i], isas[i]);
+                total_s[i] += timer.getElapsedSeconds();
+            }
+
+            if (cv::norm(masks[0], masks[1], cv::NORM_INF) != 0.0) {
+                std::cerr << "MotionMask: " << kernels::isaName(isas[1])
+                          << " output differs from scalar at frame " << frames << "\n";
+                return false;
+            }
+        }
+
+        timer.reset();
+        colour_key.run(frame, key_mask);
+        key_s += timer.getElapsedSeconds();
+
+        timer.reset();
+        cv::absdiff(frame, cv::Scalar(0, 0, 0), key_reference);
+        cv::threshold(key_reference, key_reference, 40, 255, cv::THRESH_BINARY_INV);
+        key_reference_s += timer.getElapsedSeconds();
+
+        timer.reset();
+        frame.toChannels(channels);
+        split_s += timer.getElapsedSeconds();
+
+        timer.reset();
+        Image::fromChannels(channels[0], channels[1], channels[2], interleaved);
+        interleave_s += timer.getElapsedSeconds();
+
+        timer.reset();
+        for (int c = 0; c < 3; ++c) {
+            cv::extractChannel(frame, extracted[c], c);
+        }
+        extract_s += timer.getElapsedSeconds();
+
+        timer.reset();
+        merged.create(frame.size(), CV_8UC3);
+        for (int c = 0; c < 3; ++c) {
+            cv::insertChannel(extracted[c], merged, c);
+        }
+        insert_s += timer.getElapsedSeconds();
+
+        for (int c = 0; c < 3; ++c) {
+            if (cv::norm(channels[c], extracted[c], cv::NORM_INF) != 0.0) {
+                std::cerr << "Image::toChannels: channel " << c
+                          << " differs from extractChannel at frame " << frames << "\n";
+                return false;
+            }
+        }
+        if (cv::norm(interleaved, merged, cv::NORM_INF) != 0.0) {
+            std::cerr << "Image::fromChannels: output differs from insertChannel at frame "
+                      << frames << "\n";
+            return false;
+        }
+
+        for (size_t i = 0; i < 2; ++i) {
+            timer.reset();
+            backgrounds[i].run(frame, 4, 5, 30, background_masks[i], isas[i]);
+            background_s[i] += timer.getElapsedSeconds();
+        }
+
+        if (cv::norm(background_masks[0], background_masks[1], cv::NORM_INF) != 0.0) {
+            std::cerr << "BackgroundModel: " << kernels::isaName(isas[1])
+                      << " output differs from scalar at frame " << frames << "\n";
+            return false;
+        }
+        std::swap(prev, frame);
+    }
+
+    for (size_t i = 0; i < 2; ++i) {
+        std::cout << "MotionMask, " << kernels::isaName(isas[i]) << ": "
+                  << (frames > 1 ? total_s[i] * 1e3 / (frames - 1) : 0.0) << " ms mean\n";
+    }
+    for (size_t i = 0; i < 2; ++i) {
+        std::cout << "BackgroundModel, step 4, " << kernels::isaName(isas[i]) << ": "
+                  << (frames ? background_s[i] * 1e3 / frames : 0.0) << " ms mean\n";
+    }
+    std::cout << "Image::toChannels: " << (frames ? split_s * 1e3 / frames : 0.0) << " ms, "
+              << "Image::fromChannels: " << (frames ? interleave_s * 1e3 / frames : 0.0) << " ms\n";
+    std::cout << "extractChannel x3: " << (frames ? extract_s * 1e3 / frames : 0.0) << " ms, "
+              << "insertChannel x3: " << (frames ? insert_s * 1e3 / frames : 0.0) << " ms\n";
+    std::cout << "ColourKey: " << (frames ? key_s * 1e3 / frames : 0.0) << " ms mean, "
+              << "absdiff + threshold: " << (frames ? key_reference_s * 1e3 / frames : 0.0)
+              << " ms mean\n";
+    return true;
+}
+
+/*
+ * kernels::BoxBlur against cv::blur, grey and BGR, at the detector's 320x240
+ * and at the source's resolution, for every odd kernel size from 3 to 31.
+ * Scalar and vectorized output must be identical; cv::blur may round a level
+ * differently for kernels of up to 256 pixels, never more.
+ */
+static bool benchBoxBlur(const BenchSettings& settings)
+{
+    const int REPEATS = 20;
+    const kernels::Isa isas[] = { kernels::Isa::Scalar, kernels::bestIsa() };
+
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+    Image frame;
+    if (!source->read(frame)) {
+        std::cerr << "BoxBlur: no frame to blur\n";
+        return false;
+    }
+
+    const cv::Size sizes[] = { cv::Size(320, 240), frame.size() };
+    kernels::BoxBlur blurs[2];
+    Image blurred[2];
+    Image reference;
+    Timer timer;
+
+    for (const cv::Size& size: sizes) {
+        Image bgr = frame.resized(size);
+        Image grey = bgr.toGreyscale();
+
+        for (const Image* src: { &grey, &bgr }) {
+            for (int ksize = 3; ksize <= 31; ksize += 2) {
+                double blur_s[2] = { 0.0, 0.0 };
+                for (size_t i = 0; i < 2; ++i) {
+                    blurs[i].run(*src, blurred[i], ksize, isas[i]);
+                    timer.reset();
+                    for (int r = 0; r < REPEATS; ++r) {
+                        blurs[i].run(*src, blurred[i], ksize, isas[i]);
+                    }
+                    blur_s[i] = timer.getElapsedSeconds();
+                }
+
+                cv::blur(*src, reference, { ksize, ksize });
+                timer.reset();
+                for (int r = 0; r < REPEATS; ++r) {
+                    cv::blur(*src, reference, { ksize, ksize });
+                }
+                double reference_s = timer.getElapsedSeconds();
+
+                if (cv::norm(blurred[0], blurred[1], cv::NORM_INF) != 0.0) {
+                    std::cerr << "BoxBlur: " << kernels::isaName(isas[1])
+                              << " output differs from scalar, ksize " << ksize << "\n";
+                    return false;
+                }
+                if (cv::norm(blurred[1], reference, cv::NORM_INF) > 1.0) {
+                    std::cerr << "BoxBlur: output differs from cv::blur, ksize " << ksize << "\n";
+                    return false;
+                }
+
+                std::cout << "BoxBlur " << size.width << "x" << size.height
+                          << (src->channels() == 1 ? " grey" : " BGR") << ", ksize " << ksize << ": ";
+                for (size_t i = 0; i < 2; ++i) {
+                    std::cout << kernels::isaName(isas[i]) << " " << blur_s[i] * 1e3 / REPEATS << " ms, ";
+                }
+                std::cout << "cv::blur " << reference_s * 1e3 / REPEATS << " ms\n";
+            }
+        }
+    }
+    return true;
+}
+
+/*
+ * Throughput of each kernel at every instruction set level the CPU has,
+ * whatever ARKANOID_ISA forces, in megapixels of input per second. Every
+ * level's output on the last frame must match the scalar one.
+ */
+static bool benchIsaLevels(const BenchSettings& settings)
+{
+    const size_t MAX_FRAMES = 60;
+    const cv::Size small_size(320, 240);
+
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+    std::vector<Image> frames;
+    std::vector<Image> greys;
+    Image frame;
+    while (frames.size() < std::min(settings.frames, MAX_FRAMES) && source->read(frame)) {
+        frames.push_back(Image(frame.clone()));
+        greys.push_back(frames.back().resized(small_size).toGreyscale());
+    }
+    if (frames.size() < 2) {
+        std::cerr << "ISA levels: need at least two frames\n";
+        return false;
+    }
+
+    std::vector<kernels::Isa> levels;
+    for (kernels::Isa level: { kernels::Isa::Scalar, kernels::Isa::Sse2, kernels::Isa::Avx2 }) {
+        if (level <= kernels::supportedIsa()) {
+            levels.push_back(level);
+        }
+    }
+    std::cout << "CPU supports " << kernels::isaName(kernels::supportedIsa())
+              << ", kernels run at " << kernels::isaName(kernels::bestIsa()) << "\n";
+
+    const char* names[] = { "MotionMask", "BackgroundModel", "deinterleave3", "interleave3",
+                            "boxThreshold 7", "BoxBlur 7" };
+    const size_t KERNELS = sizeof(names) / sizeof(names[0]);
+
+    const double frame_mpx = frames[0].total() / 1e6;
+    const double small_mpx = greys[0].total() / 1e6;
+    const double kernel_mpx[] = { frame_mpx, frame_mpx, frame_mpx, frame_mpx, small_mpx, frame_mpx };
+
+    std::vector<std::vector<double>> seconds(KERNELS, std::vector<double>(levels.size(), 0.0));
+    Image reference[KERNELS];
+    Timer timer;
+
+    for (size_t l = 0; l < levels.size(); ++l) {
+        const kernels::Isa isa = levels[l];
+        kernels::MotionMask motion_mask;
+        kernels::BackgroundModel background;
+        kernels::BoxBlur blur;
+        Image outputs[KERNELS];
+        std::array<Image, 3> channels;
+
+        for (size_t i = 0; i < frames.size(); ++i) {
+            if (i > 0) {
+                timer.reset();
+                motion_mask.run(frames[i - 1], frames[i], small_size, 7, 100, outputs[0], isa);
+                seconds[0][l] += timer.getElapsedSeconds();
+            }
+
+            timer.reset();
+            background.run(frames[i], 4, 5, 30, outputs[1], isa);
+            seconds[1][l] += timer.getElapsedSeconds();
+
+            const Image& colour = frames[i];
+            for (Image& channel: channels) {
+                channel.create(colour.size(), CV_8UC1);
+            }
+            outputs[3].create(colour.size(), CV_8UC3);
+
+            timer.reset();
+            for (int y = 0; y < colour.rows; ++y) {
+                kernels::deinterleave3(colour.ptr<uint8_t>(y), channels[0].ptr<uint8_t>(y),
+                                       channels[1].ptr<uint8_t>(y), channels[2].ptr<uint8_t>(y),
+                                       colour.cols, isa);
+            }
+            seconds[2][l] += timer.getElapsedSeconds();
+            outputs[2] = channels[0];
+
+            timer.reset();
+            for (int y = 0; y < colour.rows; ++y) {
+                kernels::interleave3(channels[0].ptr<uint8_t>(y), channels[1].ptr<uint8_t>(y),
+                                     channels[2].ptr<uint8_t>(y), outputs[3].ptr<uint8_t>(y),
+                                     colour.cols, isa);
+            }
+            seconds[3][l] += timer.getElapsedSeconds();
+
+            timer.reset();
+            kernels::boxThreshold(greys[i], outputs[4], 7, 100, isa);
+            seconds[4][l] += timer.getElapsedSeconds();
+
+            timer.reset();
+            blur.run(frames[i], outputs[5], 7, isa);
+            seconds[5][l] += timer.getElapsedSeconds();
+        }
+
+        for (size_t k = 0; k < KERNELS; ++k) {
+            if (l == 0) {
+                reference[k] = Image(outputs[k].clone());
+            } else if (cv::norm(outputs[k], reference[k], cv::NORM_INF) != 0.0) {
+                std::cerr << names[k] << ": " << kernels::isaName(isa) << " output differs from scalar\n";
+                return false;
+            }
+        }
+    }
+
+    for (size_t k = 0; k < KERNELS; ++k) {
+        const size_t runs = k == 0 ? frames.size() - 1 : frames.size();
+        std::cout << names[k] << ":";
+        for (size_t l = 0; l < levels.size(); ++l) {
+            std::cout << " " << kernels::isaName(levels[l]) << " "
+                      << kernel_mpx[k] * runs / seconds[k][l] << " Mpx/s";
+        }
+        std::cout << "\n";
+    }
+    return true;
+}
+
+// marker extraction alone, on the same masks the detector would see
+static void benchExtraction(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+
+    cv::Size size = source->frameSize();
+    MotionDetector detector((size_t)size.width, (size_t)size.height);
+    detector.settings = settings.detector;
+
+    kernels::MotionMask motion_mask;
+    Image small_mask;
+    Image mask;
+
+    Image prev;
+    Image frame;
+    Timer timer;
+    double contours_s = 0.0;
+    double blobs_s = 0.0;
+    size_t contours = 0;
+    size_t blobs = 0;
+    size_t frames = 0;
+
+    for (; frames < settings.frames; ++frames) {
+        if (!source->read(frame)) {
+            break;
+        }
+        frame.flip(Image::FlipAxis::Y);
+        Image curr = detector.preprocessFrame(frame);
+
+        if (!prev.empty()) {
+            motion_mask.run(prev, curr, { 320, 240 }, 7, detector.settings.motion_threshold,
+                            small_mask);
+            cv::resize(small_mask, mask, curr.size(), 0, 0, cv::INTER_NEAREST);
+
+            timer.reset();
+            contours += detector.getSignificantContours(mask).size();
+            contours_s += timer.getElapsedSeconds();
+
+            timer.reset();
+            blobs += detector.getSignificantBlobs(mask).size();
+            blobs_s += timer.getElapsedSeconds();
+        }
+        prev = std::move(curr);
+    }
+
+    size_t masks = frames > 1 ? frames - 1 : 0;
+    std::cout << "getSignificantContours: " << (masks ? contours_s * 1e3 / masks : 0.0)
+              << " ms mean, " << contours << " contours\n"
+              << "getSignificantBlobs: " << (masks ? blobs_s * 1e3 / masks : 0.0)
+              << " ms mean, " << blobs << " blobs\n";
+}
+
+/*
+ * Marker filters on the trajectory the detector measures: cost per
+ * predict + correct step, jitter (RMS frame-to-frame change of the filtered
+ * velocity) and lag (RMS distance from the raw measurement), both in board
+ * pixels.
+ */
+static void benchFilters(const BenchSettings& settings)
+{
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+
+    cv::Size size = source->frameSize();
+    MotionDetector detector((size_t)size.width, (size_t)size.height);
+    detector.settings = settings.detector;
+
+    std::vector<cv::Point2f> trajectory;
+    Image frame;
+    for (size_t frames = 0; frames < settings.frames && source->read(frame); ++frames) {
+        frame.flip(Image::FlipAxis::Y);
+        detector.nextFrame(frame);
+
+        cv::Point2f pos = detector.getMarkerPos();
+        trajectory.push_back({ pos.x / size.width, pos.y / size.height });
+    }
+
+    if (trajectory.size() < 3) {
+        std::cerr << "trajectory too short\n";
+        return;
+    }
+
+    const PositionFilterKind kinds[] = {
+        PositionFilterKind::OpenCvKalman, PositionFilterKind::Kalman, PositionFilterKind::OneEuro,
+    };
+    const char* const names[] = { "cv::KalmanFilter", "FixedKalmanFilter", "One Euro" };
+
+    for (size_t k = 0; k < 3; ++k) {
+        std::vector<cv::Point2f> filtered;
+        filtered.reserve(trajectory.size());
+
+        std::unique_ptr<PositionFilter> filter = makePositionFilter(kinds[k]);
+        for (const cv::Point2f& measurement: trajectory) {
+            filter->predict();
+            filter->correct(measurement);
+            filtered.push_back(filter->position());
+        }
+
+        double jitter = 0.0;
+        double lag = 0.0;
+        for (size_t i = 0; i < filtered.size(); ++i) {
+            cv::Point2f error = filtered[i] - trajectory[i];
+            lag += std::pow(error.x * size.width, 2) + std::pow(error.y * size.height, 2);
+
+            if (i >= 2) {
+                cv::Point2f accel = filtered[i] - filtered[i - 1] * 2.0f + filtered[i - 2];
+                jitter += std::pow(accel.x * size.width, 2) + std::pow(accel.y * size.height, 2);
+            }
+        }
+
+        const size_t UPDATES = 1000000;
+        long long start_ns = Timer::monotonicNanos();
+        for (size_t i = 0; i < UPDATES; ++i) {
+            filter->predict();
+            filter->correct(trajectory[i % trajectory.size()]);
+        }
+        double update_ns = (double)(Timer::monotonicNanos() - start_ns) / UPDATES;
+
+        std::cout << names[k] << ": " << update_ns << " ns/update, jitter "
+                  << std::sqrt(jitter / (filtered.size() - 2)) << " px, lag "
+                  << std::sqrt(lag / filtered.size()) << " px\n";
+    }
+}
+
+/*
+ * MarkerTracker::update() with MAX_TRACKS tracks and 8 candidates per frame:
+ * as many markers moving as tracks, the rest jumping around as clutter.
+ */
+// also checks that one marker split into near-duplicate candidates, as a
+// frame difference splits it, keeps a single track
+static bool benchAssignment(const BenchSettings& settings)
+{
+    const size_t CANDIDATES = 8;
+    const size_t FRAMES = std::max<size_t>(settings.frames, 100000);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> uniform(0.0f, 1.0f);
+    std::normal_distribution<float> noise(0.0f, 0.003f);
+
+    for (size_t tracks = 1; tracks <= MarkerTracker::MAX_TRACKS; ++tracks) {
+        MarkerTracker tracker;
+        MarkerTracker::Candidates candidates;
+        long long worst_ns = 0;
+        long long total_ns = 0;
+
+        for (size_t frame = 0; frame < FRAMES; ++frame) {
+            for (size_t c = 0; c < CANDIDATES; ++c) {
+                if (c < tracks) {
+                    float t = frame / 60.0f + c;
+                    candidates[c] = { 0.5f + 0.4f * std::sin(t * 1.3f) + noise(rng),
+                                      0.5f + 0.3f * std::cos(t * 0.7f) + noise(rng) };
+                } else {
+                    candidates[c] = { uniform(rng), uniform(rng) };
+                }
+            }
+            std::shuffle(candidates.begin(), candidates.begin() + CANDIDATES, rng);
+
+            long long start_ns = Timer::monotonicNanos();
+            tracker.update(candidates, CANDIDATES, tracks);
+            long long elapsed_ns = Timer::monotonicNanos() - start_ns;
+
+            total_ns += elapsed_ns;
+            worst_ns = std::max(worst_ns, elapsed_ns);
+        }
+
+        std::cout << "MarkerTracker::update, " << tracks << " tracks, " << CANDIDATES
+                  << " candidates: " << (double)total_ns / FRAMES << " ns mean, "
+                  << worst_ns / 1e3 << " us worst\n";
+    }
+
+    // one marker, its leading and trailing edges a few percent of the frame
+    // either side of it, with two slots free
+    const float SPLIT = 0.03f;
+    MarkerTracker tracker;
+    MarkerTracker::Candidates candidates;
+    for (size_t frame = 0; frame < 600; ++frame) {
+        float t = frame / 60.0f;
+        cv::Point2f marker(0.5f + 0.4f * std::sin(t * 1.3f), 0.5f + 0.3f * std::cos(t * 0.7f));
+        candidates[0] = marker + cv::Point2f(noise(rng), noise(rng));
+        candidates[1] = marker + cv::Point2f(SPLIT, 0.0f);
+        candidates[2] = marker - cv::Point2f(SPLIT, SPLIT / 2);
+        std::shuffle(candidates.begin(), candidates.begin() + 3, rng);
+
+        tracker.update(candidates, 3, 2);
+
+        MarkerTracker::Markers markers = tracker.markers({ 1, 1 });
+        size_t alive = 0;
+        for (const TrackedMarker& track: markers) {
+            alive += track.alive ? 1 : 0;
+        }
+        if (alive != 1) {
+            std::cerr << "MarkerTracker: one split marker keeps " << alive
+                      << " tracks alive at frame " << frame << "\n";
+            return false;
+        }
+    }
+    std::cout << "MarkerTracker: one split marker, one track\n";
+    return true;
+}
+
+/*
+ * Heap allocations per frame in the detector thread's steady state: flip,
+ * then nextFrame().
+ *
+ * Only the still scene, one frame over and over, is checked. Its motion
+ * mask is empty, so extraction never runs: the check covers preprocessing
+ * and the motion mask (or the change map, which skips it), not the
+ * contour and blob stages. With --unfused only the cv::Mat buffers are
+ * checked, as the OpenCV calls in the step-by-step mask allocate
+ * internally.
+ *
+ * The moving scene is reported, not checked. Its count mixes the
+ * detector's own buffers with what findContours and
+ * connectedComponentsWithStats allocate internally, and nothing here
+ * tells the two apart.
+ */
+static bool benchAllocations(const BenchSettings& settings)
+{
+    const size_t WARMUP_FRAMES = 10;
+
+    std::unique_ptr<FrameSource> source = openBenchSource(settings);
+    cv::Size size = source->frameSize();
+
+    CountingMatAllocator mat_allocations;
+    cv::MatAllocator* default_allocator = cv::Mat::getDefaultAllocator();
+    cv::Mat::setDefaultAllocator(&mat_allocations);
+
+    MotionDetector detector((size_t)size.width, (size_t)size.height);
+    detector.settings = settings.detector;
+
+    Image still;
+    Image frame;
+    source->read(still);
+
+    size_t heap[2] = { 0, 0 };
+    size_t mats[2] = { 0, 0 };
+    size_t frames[2] = { 0, 0 };
+
+    for (int moving = 0; moving < 2; ++moving) {
+        for (size_t i = 0; i < WARMUP_FRAMES + settings.frames; ++i) {
+            if (moving) {
+                if (!source->read(frame)) {
+                    break;
+                }
+            } else {
+                still.copyTo(frame);
+            }
+
+            size_t heap_before = heap_allocations;
+            size_t mats_before = mat_allocations.allocations;
+
+            frame.flip(Image::FlipAxis::Y);
+            detector.nextFrame(frame);
+
+            if (i >= WARMUP_FRAMES) {
+                heap[moving] += heap_allocations - heap_before;
+                mats[moving] += mat_allocations.allocations - mats_before;
+                ++frames[moving];
+            }
+        }
+    }
+
+    cv::Mat::setDefaultAllocator(default_allocator);
+
+    const char* names[] = { "still scene, checked", "moving scene, not checked" };
+    for (int moving = 0; moving < 2; ++moving) {
+        size_t n = std::max<size_t>(frames[moving], 1);
+        std::cout << "flip + nextFrame, " << names[moving] << ", " << frames[moving]
+                  << " frames: " << (double)heap[moving] / n << " operator new, "
+                  << (double)mats[moving] / n << " cv::Mat buffers per frame\n";
+    }
+
+    bool heap_checked = settings.detector.fused_motion_kernel;
+    if ((heap_checked && heap[0] != 0) || mats[0] != 0) {
+        std::cerr << "steady-state nextFrame allocates with an empty motion mask\n";
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char** argv)
+{
+    BenchSettings settings;
+    settings.source.kind = FrameSourceSettings::Kind::Synthetic;
+    settings.source.loop = false;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--video" && i + 1 < argc) {
+            settings.source.kind = FrameSourceSettings::Kind::VideoFile;
+            settings.source.path = argv[++i];
+        } else if (arg == "--frames" && i + 1 < argc) {
+            settings.frames = (size_t)std::atol(argv[++i]);
+        } else if (arg == "--workers" && i + 1 < argc) {
+            settings.workers = (size_t)std::atol(argv[++i]);
+        } else if (arg == "--pyramid-level" && i + 1 < argc) {
+            settings.detector.pyramid_level = std::atoi(argv[++i]);
+        } else if (arg == "--background-model") {
+            settings.detector.mode = DetectionMode::BackgroundModel;
+        } else if (arg == "--calibration" && i + 1 < argc) {
+            Calibration calibration = Calibration::from(settings.detector);
+            if (!calibration.load(argv[++i])) {
+                std::cerr << "cannot load calibration " << argv[i] << "\n";
+                return 1;
+            }
+            calibration.applyTo(settings.detector);
+        } else if (arg == "--optical-flow") {
+            settings.detector.mode = DetectionMode::OpticalFlow;
+        } else if (arg == "--track-window") {
+            settings.detector.track_window = true;
+        } else if (arg == "--skip-static-tiles") {
+            settings.detector.skip_static_tiles = true;
+        } else if (arg == "--connected-components") {
+            settings.detector.connected_components = true;
+        } else if (arg == "--unfused") {
+            settings.detector.fused_motion_kernel = false;
+        } else if (arg == "--allocations") {
+            settings.allocations = true;
+        } else if (arg == "--assignment") {
+            settings.assignment = true;
+        } else if (arg == "--filters") {
+            settings.filters = true;
+        } else if (arg == "--extraction") {
+            settings.extraction = true;
+        } else if (arg == "--kernels") {
+            settings.kernels = true;
+        } else if (arg == "--isa-levels") {
+            settings.isa_levels = true;
+        } else {
+            std::cerr << "usage: " << argv[0] << " [--video PATH] [--frames N] [--workers N]"
+                         " [--pyramid-level N] [--connected-components] [--skip-static-tiles]"
+                         " [--unfused] [--track-window] [--optical-flow | --background-model]"
+                         " [--calibration PATH]"
+                         " [--kernels | --isa-levels | --extraction | --filters | --assignment | --allocations]\n";
+            return 1;
+        }
+    }
+
+    if (settings.kernels) {
+        return benchMotionKernels(settings) && benchBoxBlur(settings) ? 0 : 1;
+    }
+
+    if (settings.isa_levels) {
+        return benchIsaLevels(settings) ? 0 : 1;
+    }
+
+    if (settings.allocations) {
+        return benchAllocations(settings) ? 0 : 1;
+    }
+
+    if (settings.assignment) {
+        return benchAssignment(settings) ? 0 : 1;
+    }
+
+    if (settings.filters) {
+        benchFilters(settings);
+        return 0;
+    }
+
+    if (settings.extraction) {
+        benchExtraction(settings);
+        return 0;
+    }
+
+    if (settings.workers > 0) {
+        // DetectorPool only differences frames; see MotionDetector::Settings::mode
+        if (settings.detector.mode != DetectionMode::FrameDifference) {
+            std::cerr << "--optical-flow and --background-model cannot be used with --workers\n";
+            return 1;
+        }
+        benchDetectorPool(settings);
+    } else {
+        benchDetector(settings);
+    }
+    return 0;
+}
@@ -0,0 +1,1123 @@
+#include "image_kernels.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+#ifdef ARKANOID_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef ARKANOID_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#if defined(ARKANOID_AVX2) && defined(__GNUC__)
+#define ARKANOID_TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define ARKANOID_TARGET_AVX2
+#endif
+
+namespace kernels {
+
+namespace {
+
+const int RESIZE_BITS = 11;
+const int RESIZE_ONE = 1 << RESIZE_BITS;
+
+// fixed-point weights of cv::COLOR_RGB2GRAY; applied to BGR data the way the
+// old chain did, so channel 0 gets the red weight
+const int GREY_SHIFT = 14;
+const int GREY_WEIGHTS[3] = { 4899, 9617, 1868 };
+
+int reflect101(int idx,
+               int size)
+{
+    if (size == 1) {
+        return 0;
+    }
+
+    while (idx < 0 || idx >= size) {
+        idx = idx < 0 ? -idx : 2 * size - 2 - idx;
+    }
+    return idx;
+}
+
+// kernels up to this area divide exactly through a float reciprocal rounded
+// up by 2^-20: the error stays below 1 / area for quotients up to 255
+const int MAX_FLOAT_DIVISION_AREA = 3600;
+
+#ifdef ARKANOID_AVX2
+/*
+ * AVX2 bodies of the kernels below. Each does the whole 32-byte blocks and
+ * returns how far it got; the caller's SSE2 and scalar loops do the rest.
+ */
+
+ARKANOID_TARGET_AVX2
+int subtractSaturatedAvx2(const uint8_t* prev,
+                          const uint8_t* curr,
+                          uint8_t* out,
+                          int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(curr + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(prev + i));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_subs_epu8(a, b));
+    }
+    return i;
+}
+
+ARKANOID_TARGET_AVX2
+int slideColumnSumsAvx2(uint16_t* vsum,
+                        const uint8_t* add,
+                        const uint8_t* sub,
+                        int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int half = 0; half < 32; half += 16) {
+            __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(add + i + half)));
+            __m256i s = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(sub + i + half)));
+            __m256i v = _mm256_loadu_si256((const __m256i*)(vsum + i + half));
+            _mm256_storeu_si256((__m256i*)(vsum + i + half), _mm256_add_epi16(v, _mm256_sub_epi16(a, s)));
+        }
+    }
+    return i;
+}
+
+ARKANOID_TARGET_AVX2
+int slideBoxSumsAvx2(uint32_t* vsum,
+                     const uint16_t* add,
+                     const uint16_t* sub,
+                     int n)
+{
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        for (int part = 0; part < 32; part += 8) {
+            __m256i a = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(add + i + part)));
+            __m256i s = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(sub + i + part)));
+            __m256i v = _mm256_loadu_si256((const __m256i*)(vsum + i + part));
+            _mm256_storeu_si256((__m256i*)(vsum + i + part), _mm256_add_epi32(v, _mm256_sub_epi32(a, s)));
+        }
+    }
+    return i;
+}
+
+ARKANOID_TARGET_AVX2
+int divideBoxSumsAvx2(const uint32_t* vsum,
+                      uint8_t* out,
+                      int n,
+                      int area)
+{
+    const __m256i bias = _mm256_set1_epi32((area - 1) / 2);
+    const __m256 scale = _mm256_set1_ps((float)((1.0 + 1.0 / (1 << 20)) / area));
+    // the packs work within 128-bit lanes; this puts the 4-byte groups back
+    // in source order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    int i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i q[4];
+        for (int j = 0; j < 4; ++j) {
+            __m256i sum = _mm256_add_epi32(_mm256_loadu_si256((const __m256i*)(vsum + i + 8 * j)), bias);
+            q[j] = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+        }
+
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]),
+                                             _mm256_packs_epi32(q[2], q[3]));
+        _mm256_storeu_si256((__m256i*)(out + i), _mm256_permutevar8x32_epi32(packed, order));
+    }
+    return i;
+}
+#endif
+
+void subtractSaturated(const uint8_t* prev,
+                       const uint8_t* curr,
+                       uint8_t* out,
+                       int n,
+                       Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_AVX2
+    if (isa >= Isa::Avx2) {
+        i = subtractSaturatedAvx2(prev, curr, out, n);
+    }
+#endif
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(curr + i));
+            __m128i b = _mm_loadu_si128((const __m128i*)(prev + i));
+            _mm_storeu_si128((__m128i*)(out + i), _mm_subs_epu8(a, b));
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        out[i] = (uint8_t)(curr[i] > prev[i] ? curr[i] - prev[i] : 0);
+    }
+}
+
+// vsum[i] += add[i] - sub[i]
+void slideColumnSums(uint16_t* vsum,
+                     const uint8_t* add,
+                     const uint8_t* sub,
+                     int n,
+                     Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_AVX2
+    if (isa >= Isa::Avx2) {
+        i = slideColumnSumsAvx2(vsum, add, sub, n);
+    }
+#endif
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 16 <= n; i += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(add + i));
+            __m128i s = _mm_loadu_si128((const __m128i*)(sub + i));
+            __m128i lo = _mm_loadu_si128((const __m128i*)(vsum + i));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(vsum + i + 8));
+
+            lo = _mm_add_epi16(lo, _mm_sub_epi16(_mm_unpacklo_epi8(a, zero),
+                                                 _mm_unpacklo_epi8(s, zero)));
+            hi = _mm_add_epi16(hi, _mm_sub_epi16(_mm_unpackhi_epi8(a, zero),
+                                                 _mm_unpackhi_epi8(s, zero)));
+
+            _mm_storeu_si128((__m128i*)(vsum + i), lo);
+            _mm_storeu_si128((__m128i*)(vsum + i + 8), hi);
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        vsum[i] = (uint16_t)(vsum[i] + add[i] - sub[i]);
+    }
+}
+
+// out[x] = sum(padded[x .. x + ksize)) >= limit ? 255 : 0
+void thresholdRowSums(const uint16_t* padded,
+                      uint8_t* out,
+                      int width,
+                      int ksize,
+                      int limit,
+                      bool fits_int16,
+                      Isa isa)
+{
+    int x = 0;
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2 && fits_int16) {
+        const __m128i bound = _mm_set1_epi16((short)(limit - 1));
+        for (; x + 8 <= width; x += 8) {
+            __m128i sum = _mm_loadu_si128((const __m128i*)(padded + x));
+            for (int k = 1; k < ksize; ++k) {
+                sum = _mm_add_epi16(sum, _mm_loadu_si128((const __m128i*)(padded + x + k)));
+            }
+
+            __m128i hit = _mm_cmpgt_epi16(sum, bound);
+            _mm_storel_epi64((__m128i*)(out + x), _mm_packs_epi16(hit, hit));
+        }
+    }
+#else
+    (void)isa;
+    (void)fits_int16;
+#endif
+
+    if (x >= width) {
+        return;
+    }
+
+    int sum = 0;
+    for (int k = 0; k < ksize; ++k) {
+        sum += padded[x + k];
+    }
+    for (; x < width; ++x) {
+        out[x] = (uint8_t)(sum >= limit ? 255 : 0);
+        if (x + 1 < width) {
+            sum += padded[x + ksize] - padded[x];
+        }
+    }
+}
+
+
+#ifdef ARKANOID_SSE2
+/*
+ * 32 pixels of 3 interleaved channels in v[0..5], in memory order. Five
+ * rounds of byte unpacking, each pairing register i with i + 3, leave
+ * channel c in v[2c] (pixels 0-15) and v[2c + 1] (16-31).
+ */
+inline void deinterleave3x32(__m128i v[6])
+{
+    for (int round = 0; round < 5; ++round) {
+        __m128i t[6];
+        for (int i = 0; i < 3; ++i) {
+            t[2 * i] = _mm_unpacklo_epi8(v[i], v[i + 3]);
+            t[2 * i + 1] = _mm_unpackhi_epi8(v[i], v[i + 3]);
+        }
+        for (int i = 0; i < 6; ++i) {
+            v[i] = t[i];
+        }
+    }
+}
+
+// the inverse: each round splits even and odd bytes back apart
+inline void interleave3x32(__m128i v[6])
+{
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+
+    for (int round = 0; round < 5; ++round) {
+        __m128i t[6];
+        for (int i = 0; i < 3; ++i) {
+            __m128i a = v[2 * i];
+            __m128i b = v[2 * i + 1];
+            t[i] = _mm_packus_epi16(_mm_and_si128(a, low_bytes), _mm_and_si128(b, low_bytes));
+            t[i + 3] = _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8));
+        }
+        for (int i = 0; i < 6; ++i) {
+            v[i] = t[i];
+        }
+    }
+}
+#endif
+
+// mask[i] = |sample[i] - model[i] / 256| > threshold ? 255 : 0, then model[i]
+// moves 1/2^shift of the way towards sample[i] * 256
+void updateBackground(uint16_t* model,
+                      const uint8_t* samples,
+                      uint8_t* mask,
+                      int n,
+                      int shift,
+                      int threshold,
+                      Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i bound = _mm_set1_epi16((short)threshold);
+        const __m128i count = _mm_cvtsi32_si128(shift);
+
+        for (; i + 16 <= n; i += 16) {
+            __m128i s = _mm_loadu_si128((const __m128i*)(samples + i));
+            __m128i hits[2];
+
+            for (int half = 0; half < 2; ++half) {
+                __m128i value = half == 0 ? _mm_unpacklo_epi8(s, zero) : _mm_unpackhi_epi8(s, zero);
+                __m128i bg = _mm_loadu_si128((const __m128i*)(model + i + 8 * half));
+
+                __m128i level = _mm_srli_epi16(bg, 8);
+                __m128i diff = _mm_or_si128(_mm_subs_epu16(value, level), _mm_subs_epu16(level, value));
+                hits[half] = _mm_cmpgt_epi16(diff, bound);
+
+                __m128i target = _mm_slli_epi16(value, 8);
+                __m128i up = _mm_srl_epi16(_mm_subs_epu16(target, bg), count);
+                __m128i down = _mm_srl_epi16(_mm_subs_epu16(bg, target), count);
+                bg = _mm_sub_epi16(_mm_add_epi16(bg, up), down);
+                _mm_storeu_si128((__m128i*)(model + i + 8 * half), bg);
+            }
+
+            _mm_storeu_si128((__m128i*)(mask + i), _mm_packs_epi16(hits[0], hits[1]));
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        const int value = samples[i];
+        const int bg = model[i];
+
+        mask[i] = (uint8_t)(std::abs(value - (bg >> 8)) > threshold ? 255 : 0);
+
+        const int target = value << 8;
+        const int up = target > bg ? (target - bg) >> shift : 0;
+        const int down = bg > target ? (bg - target) >> shift : 0;
+        model[i] = (uint16_t)(bg + up - down);
+    }
+}
+
+// out[i] = sum of the ksize pixels from padded[i] on, channels interleaved
+// `cn` apart
+void rowBoxSums(const uint8_t* padded,
+                uint16_t* out,
+                int n,
+                int cn,
+                int ksize)
+{
+    for (int c = 0; c < cn; ++c) {
+        int sum = 0;
+        for (int k = 0; k < ksize; ++k) {
+            sum += padded[c + k * cn];
+        }
+        out[c] = (uint16_t)sum;
+    }
+
+    const int span = ksize * cn;
+    for (int i = cn; i < n; ++i) {
+        out[i] = (uint16_t)(out[i - cn] + padded[i - cn + span] - padded[i - cn]);
+    }
+}
+
+// vsum[i] += add[i] - sub[i]
+void slideBoxSums(uint32_t* vsum,
+                  const uint16_t* add,
+                  const uint16_t* sub,
+                  int n,
+                  Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_AVX2
+    if (isa >= Isa::Avx2) {
+        i = slideBoxSumsAvx2(vsum, add, sub, n);
+    }
+#endif
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 8 <= n; i += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(add + i));
+            __m128i s = _mm_loadu_si128((const __m128i*)(sub + i));
+            __m128i lo = _mm_loadu_si128((const __m128i*)(vsum + i));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(vsum + i + 4));
+
+            lo = _mm_add_epi32(lo, _mm_sub_epi32(_mm_unpacklo_epi16(a, zero),
+                                                 _mm_unpacklo_epi16(s, zero)));
+            hi = _mm_add_epi32(hi, _mm_sub_epi32(_mm_unpackhi_epi16(a, zero),
+                                                 _mm_unpackhi_epi16(s, zero)));
+
+            _mm_storeu_si128((__m128i*)(vsum + i), lo);
+            _mm_storeu_si128((__m128i*)(vsum + i + 4), hi);
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        vsum[i] += (uint32_t)add[i] - sub[i];
+    }
+}
+
+// out[i] = round(vsum[i] / area), area odd so there are no ties
+void divideBoxSums(const uint32_t* vsum,
+                   uint8_t* out,
+                   int n,
+                   int area,
+                   Isa isa)
+{
+    const uint32_t half = (uint32_t)(area - 1) / 2;
+    int i = 0;
+
+#ifdef ARKANOID_AVX2
+    if (isa >= Isa::Avx2 && area <= MAX_FLOAT_DIVISION_AREA) {
+        i = divideBoxSumsAvx2(vsum, out, n, area);
+    }
+#endif
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2 && area <= MAX_FLOAT_DIVISION_AREA) {
+        const __m128i bias = _mm_set1_epi32((int)half);
+        const __m128 scale = _mm_set1_ps((float)((1.0 + 1.0 / (1 << 20)) / area));
+
+        for (; i + 16 <= n; i += 16) {
+            __m128i q[4];
+            for (int j = 0; j < 4; ++j) {
+                __m128i sum = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(vsum + i + 4 * j)), bias);
+                q[j] = _mm_cvttps_epi32(_mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+            }
+
+            __m128i lo = _mm_packs_epi32(q[0], q[1]);
+            __m128i hi = _mm_packs_epi32(q[2], q[3]);
+            _mm_storeu_si128((__m128i*)(out + i), _mm_packus_epi16(lo, hi));
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    // floor(x / area) as (x * ceil(2^40 / area)) >> 40, exact for x < 2^24
+    const uint64_t reciprocal = (((uint64_t)1 << 40) + area - 1) / area;
+    for (; i < n; ++i) {
+        out[i] = (uint8_t)(((uint64_t)(vsum[i] + half) * reciprocal) >> 40);
+    }
+}
+
+}
+
+void deinterleave3(const uint8_t* src,
+                   uint8_t* c0,
+                   uint8_t* c1,
+                   uint8_t* c2,
+                   int n,
+                   Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        uint8_t* planes[3] = { c0, c1, c2 };
+        for (; i + 32 <= n; i += 32) {
+            __m128i v[6];
+            for (int k = 0; k < 6; ++k) {
+                v[k] = _mm_loadu_si128((const __m128i*)(src + 3 * i + 16 * k));
+            }
+            deinterleave3x32(v);
+            for (int c = 0; c < 3; ++c) {
+                _mm_storeu_si128((__m128i*)(planes[c] + i), v[2 * c]);
+                _mm_storeu_si128((__m128i*)(planes[c] + i + 16), v[2 * c + 1]);
+            }
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        c0[i] = src[3 * i];
+        c1[i] = src[3 * i + 1];
+        c2[i] = src[3 * i + 2];
+    }
+}
+
+void interleave3(const uint8_t* c0,
+                 const uint8_t* c1,
+                 const uint8_t* c2,
+                 uint8_t* dst,
+                 int n,
+                 Isa isa)
+{
+    int i = 0;
+
+#ifdef ARKANOID_SSE2
+    if (isa >= Isa::Sse2) {
+        const uint8_t* planes[3] = { c0, c1, c2 };
+        for (; i + 32 <= n; i += 32) {
+            __m128i v[6];
+            for (int c = 0; c < 3; ++c) {
+                v[2 * c] = _mm_loadu_si128((const __m128i*)(planes[c] + i));
+                v[2 * c + 1] = _mm_loadu_si128((const __m128i*)(planes[c] + i + 16));
+            }
+            interleave3x32(v);
+            for (int k = 0; k < 6; ++k) {
+                _mm_storeu_si128((__m128i*)(dst + 3 * i + 16 * k), v[k]);
+            }
+        }
+    }
+#else
+    (void)isa;
+#endif
+
+    for (; i < n; ++i) {
+        dst[3 * i] = c0[i];
+        dst[3 * i + 1] = c1[i];
+        dst[3 * i + 2] = c2[i];
+    }
+}
+
+namespace {
+
+Isa probeIsa()
+{
+#if defined(ARKANOID_AVX2) && defined(__GNUC__)
+    // checks the OS saves the YMM registers too
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return Isa::Avx2;
+    }
+#elif defined(ARKANOID_AVX2)
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] >= 7) {
+        __cpuid(regs, 1);
+        const bool avx = (regs[2] & (1 << 27)) && (regs[2] & (1 << 28));
+        const bool ymm_saved = avx && (_xgetbv(0) & 6) == 6;
+
+        __cpuidex(regs, 7, 0);
+        if (ymm_saved && (regs[1] & (1 << 5))) {
+            return Isa::Avx2;
+        }
+    }
+#endif
+
+#ifdef ARKANOID_SSE2
+    // the build itself already requires it
+    return Isa::Sse2;
+#else
+    return Isa::Scalar;
+#endif
+}
+
+Isa selectIsa()
+{
+    Isa isa = supportedIsa();
+
+    const char* name = std::getenv("ARKANOID_ISA");
+    if (!name) {
+        return isa;
+    }
+
+    Isa forced;
+    if (!parseIsa(name, forced)) {
+        std::cerr << "ARKANOID_ISA=" << name << " is not scalar, sse2 or avx2; ignored\n";
+    } else if (forced > isa) {
+        std::cerr << "ARKANOID_ISA=" << name << " is not supported by this CPU; using "
+                  << isaName(isa) << "\n";
+    } else {
+        isa = forced;
+    }
+    return isa;
+}
+
+}
+
+Isa supportedIsa()
+{
+    static const Isa isa = probeIsa();
+    return isa;
+}
+
+Isa bestIsa()
+{
+    static const Isa isa = selectIsa();
+    return isa;
+}
+
+const char* isaName(Isa isa)
+{
+    switch (isa) {
+    case Isa::Avx2:
+        return "avx2";
+    case Isa::Sse2:
+        return "sse2";
+    case Isa::Scalar:
+    default:
+        return "scalar";
+    }
+}
+
+bool parseIsa(const char* name,
+              Isa& isa)
+{
+    for (Isa level: { Isa::Scalar, Isa::Sse2, Isa::Avx2 }) {
+        if (std::strcmp(name, isaName(level)) == 0) {
+            isa = level;
+            return true;
+        }
+    }
+    return false;
+}
+
+void boxThreshold(const cv::Mat& src,
+                  cv::Mat& dst,
+                  int ksize,
+                  int threshold,
+                  Isa isa)
+{
+    std::vector<uint16_t> column_sums;
+    boxThreshold(src, dst, ksize, threshold, isa, column_sums);
+}
+
+void boxThreshold(const cv::Mat& src,
+                  cv::Mat& dst,
+                  int ksize,
+                  int threshold,
+                  Isa isa,
+                  std::vector<uint16_t>& column_sums)
+{
+    CV_Assert(src.type() == CV_8UC1 && ksize > 0 && ksize % 2 == 1);
+    CV_Assert(ksize * 255 <= 0xffff);
+
+    const int width = src.cols;
+    const int height = src.rows;
+    const int radius = ksize / 2;
+    const int area = ksize * ksize;
+
+    // round(sum / area) > threshold  <=>  2 * sum >= area * (2 * threshold + 1)
+    const int limit = (area * (2 * threshold + 1) + 1) / 2;
+    const bool fits_int16 = area * 255 <= 0x7fff;
+
+    dst.create(src.size(), CV_8UC1);
+
+    // column sums over the vertical window, padded by `radius` on both sides
+    column_sums.assign((size_t)(width + 2 * radius), 0);
+    uint16_t* vsum = column_sums.data() + radius;
+
+    for (int k = -radius; k <= radius; ++k) {
+        const uint8_t* row = src.ptr<uint8_t>(reflect101(k, height));
+        for (int x = 0; x < width; ++x) {
+            vsum[x] = (uint16_t)(vsum[x] + row[x]);
+        }
+    }
+
+    for (int y = 0; y < height; ++y) {
+        if (y > 0) {
+            slideColumnSums(vsum,
+                            src.ptr<uint8_t>(reflect101(y + radius, height)),
+                            src.ptr<uint8_t>(reflect101(y - 1 - radius, height)),
+                            width, isa);
+        }
+
+        for (int k = 1; k <= radius; ++k) {
+            vsum[-k] = vsum[reflect101(-k, width)];
+            vsum[width - 1 + k] = vsum[reflect101(width - 1 + k, width)];
+        }
+
+        thresholdRowSums(column_sums.data(), dst.ptr<uint8_t>(y), width, ksize, limit,
+                         fits_int16, isa);
+    }
+}
+
+void BoxBlur::run(const cv::Mat& src,
+                  cv::Mat& dst,
+                  int ksize,
+                  Isa isa)
+{
+    CV_Assert(src.depth() == CV_8U && (src.channels() == 1 || src.channels() == 3));
+    CV_Assert(ksize > 0 && ksize % 2 == 1 && ksize * 255 <= 0xffff);
+
+    const int width = src.cols;
+    const int height = src.rows;
+    const int cn = src.channels();
+    const int n = width * cn;
+    const int radius = ksize / 2;
+
+    // the bottom border reflects back into the ring only while one
+    // reflection is enough; past that, in place needs a copy of the source
+    const bool ring_reflects = radius < height;
+    if (!ring_reflects && src.data == dst.data) {
+        src.copyTo(_copy);
+        run(_copy, dst, ksize, isa);
+        return;
+    }
+
+    dst.create(src.size(), src.type());
+    if (src.empty()) {
+        return;
+    }
+
+    _padded.resize((size_t)(width + 2 * radius) * cn);
+    _ring.resize((size_t)ksize * n);
+    _entering.resize((size_t)n);
+    _column_sums.assign((size_t)n, 0);
+
+    for (int row = -radius; row <= radius; ++row) {
+        uint16_t* sums = ringRow(row, ksize, n);
+        sumRow(src, row, ksize, sums);
+        for (int i = 0; i < n; ++i) {
+            _column_sums[i] += sums[i];
+        }
+    }
+
+    for (int y = 0; y < height; ++y) {
+        if (y > 0) {
+            // the row entering the window takes the slot of the one leaving it
+            const int entering = y + radius;
+            uint16_t* leaving = ringRow(entering, ksize, n);
+
+            if (entering >= height && ring_reflects) {
+                const uint16_t* reflected = ringRow(reflect101(entering, height), ksize, n);
+                std::memcpy(_entering.data(), reflected, (size_t)n * sizeof(uint16_t));
+            } else {
+                sumRow(src, entering, ksize, _entering.data());
+            }
+
+            slideBoxSums(_column_sums.data(), _entering.data(), leaving, n, isa);
+            std::memcpy(leaving, _entering.data(), (size_t)n * sizeof(uint16_t));
+        }
+
+        divideBoxSums(_column_sums.data(), dst.ptr<uint8_t>(y), n, ksize * ksize, isa);
+    }
+}
+
+uint16_t* BoxBlur::ringRow(int row,
+                           int ksize,
+                           int n)
+{
+    return _ring.data() + (size_t)(((row % ksize) + ksize) % ksize) * n;
+}
+
+void BoxBlur::sumRow(const cv::Mat& src,
+                     int row,
+                     int ksize,
+                     uint16_t* out)
+{
+    const int width = src.cols;
+    const int cn = src.channels();
+    const int radius = ksize / 2;
+    const uint8_t* source = src.ptr<uint8_t>(reflect101(row, src.rows));
+
+    uint8_t* padded = _padded.data();
+    std::memcpy(padded + radius * cn, source, (size_t)(width * cn));
+    for (int k = 1; k <= radius; ++k) {
+        std::memcpy(padded + (radius - k) * cn, source + reflect101(-k, width) * cn, (size_t)cn);
+        std::memcpy(padded + (radius + width - 1 + k) * cn,
+                    source + reflect101(width - 1 + k, width) * cn, (size_t)cn);
+    }
+
+    rowBoxSums(padded, out, width * cn, cn, ksize);
+}
+
+void boxBlur(const cv::Mat& src,
+             cv::Mat& dst,
+             int ksize,
+             Isa isa)
+{
+    static thread_local BoxBlur blur;
+    blur.run(src, dst, ksize, isa);
+}
+
+MotionMask::MotionMask():
+    _channels(0),
+    _diff_row_idx{ -1, -1 },
+    _next_diff_slot(0)
+{
+}
+
+void MotionMask::prepare(const cv::Size& src_size,
+                         int channels,
+                         const cv::Size& small_size)
+{
+    if (src_size == _src_size && small_size == _small_size && channels == _channels) {
+        return;
+    }
+
+    _src_size = src_size;
+    _small_size = small_size;
+    _channels = channels;
+
+    // same sample positions as cv::resize with INTER_LINEAR
+    const double scale_x = (double)src_size.width / small_size.width;
+    _x_ofs.resize((size_t)small_size.width);
+    _x_ofs_right.resize((size_t)small_size.width);
+    _x_coef.resize((size_t)small_size.width);
+    for (int x = 0; x < small_size.width; ++x) {
+        double fx = (x + 0.5) * scale_x - 0.5;
+        int sx = (int)std::floor(fx);
+        fx -= sx;
+        if (sx < 0) {
+            sx = 0;
+            fx = 0;
+        }
+        if (sx >= src_size.width - 1) {
+            sx = src_size.width - 1;
+            fx = 0;
+        }
+
+        _x_ofs[x] = sx * channels;
+        _x_ofs_right[x] = std::min(sx + 1, src_size.width - 1) * channels;
+        _x_coef[x] = RESIZE_ONE - (int)std::lround(fx * RESIZE_ONE);
+    }
+
+    const double scale_y = (double)src_size.height / small_size.height;
+    _y_ofs.resize((size_t)small_size.height);
+    _y_coef.resize((size_t)small_size.height);
+    for (int y = 0; y < small_size.height; ++y) {
+        double fy = (y + 0.5) * scale_y - 0.5;
+        int sy = (int)std::floor(fy);
+        fy -= sy;
+        if (sy < 0) {
+            sy = 0;
+            fy = 0;
+        }
+        if (sy >= src_size.height - 1) {
+            sy = src_size.height - 1;
+            fy = 0;
+        }
+
+        _y_ofs[y] = sy;
+        _y_coef[y] = RESIZE_ONE - (int)std::lround(fy * RESIZE_ONE);
+    }
+
+    for (std::vector<uint8_t>& row: _diff_rows) {
+        row.resize((size_t)(src_size.width * channels));
+    }
+    _diff_row_idx[0] = _diff_row_idx[1] = -1;
+
+    _planes.create(small_size.height * channels, small_size.width, CV_8UC1);
+    _grey.create(small_size, CV_8UC1);
+}
+
+const uint8_t* MotionMask::diffRow(const cv::Mat& prev,
+                                   const cv::Mat& curr,
+                                   int row,
+                                   Isa isa)
+{
+    for (int slot = 0; slot < 2; ++slot) {
+        if (_diff_row_idx[slot] == row) {
+            _next_diff_slot = 1 - slot;
+            return _diff_rows[slot].data();
+        }
+    }
+
+    int slot = _next_diff_slot;
+    _next_diff_slot = 1 - slot;
+    _diff_row_idx[slot] = row;
+
+    subtractSaturated(prev.ptr<uint8_t>(row), curr.ptr<uint8_t>(row),
+                      _diff_rows[slot].data(), _src_size.width * _channels, isa);
+    return _diff_rows[slot].data();
+}
+
+void MotionMask::run(const cv::Mat& prev,
+                     const cv::Mat& curr,
+                     const cv::Size& small_size,
+                     int blur_size,
+                     int threshold,
+                     cv::Mat& mask,
+                     Isa isa)
+{
+    CV_Assert(prev.size() == curr.size() && prev.type() == curr.type());
+    CV_Assert(curr.type() == CV_8UC1 || curr.type() == CV_8UC3);
+
+    const int channels = curr.channels();
+    prepare(curr.size(), channels, small_size);
+    _diff_row_idx[0] = _diff_row_idx[1] = -1;
+    std::memset(_hist, 0, sizeof(_hist));
+
+    // pass 1: difference of the two source rows each output row samples,
+    // bilinear downscale, per-channel histograms
+    for (int y = 0; y < small_size.height; ++y) {
+        const int sy = _y_ofs[y];
+        const uint8_t* top = diffRow(prev, curr, sy, isa);
+        const uint8_t* bottom = diffRow(prev, curr, std::min(sy + 1, _src_size.height - 1), isa);
+        const int cy0 = _y_coef[y];
+        const int cy1 = RESIZE_ONE - cy0;
+
+        for (int c = 0; c < channels; ++c) {
+            uint8_t* out = _planes.ptr<uint8_t>(c * small_size.height + y);
+            uint32_t* hist = _hist[c];
+
+            for (int x = 0; x < small_size.width; ++x) {
+                const int left = _x_ofs[x] + c;
+                const int right = _x_ofs_right[x] + c;
+                const int cx0 = _x_coef[x];
+                const int cx1 = RESIZE_ONE - cx0;
+
+                int value = ((top[left] * cx0 + top[right] * cx1) * cy0
+                             + (bottom[left] * cx0 + bottom[right] * cx1) * cy1
+                             + (1 << (2 * RESIZE_BITS - 1))) >> (2 * RESIZE_BITS);
+
+                out[x] = (uint8_t)value;
+                ++hist[value];
+            }
+        }
+    }
+
+    // equalizeHist lookup tables, premultiplied by the grey weights
+    const uint32_t total = (uint32_t)small_size.area();
+    for (int c = 0; c < channels; ++c) {
+        const uint32_t* hist = _hist[c];
+        const int weight = channels == 1 ? (1 << GREY_SHIFT) : GREY_WEIGHTS[c];
+        int* lut = _weighted_lut[c];
+
+        int first = 0;
+        while (first < 255 && hist[first] == 0) {
+            ++first;
+        }
+
+        if (hist[first] == total) {
+            std::fill(lut, lut + 256, first * weight);
+            continue;
+        }
+
+        const float scale = 255.0f / (float)(total - hist[first]);
+        uint32_t sum = 0;
+        std::fill(lut, lut + first + 1, 0);
+        for (int v = first + 1; v < 256; ++v) {
+            sum += hist[v];
+            lut[v] = std::min(255, (int)std::lround(sum * scale)) * weight;
+        }
+    }
+
+    // pass 2: equalize and merge channels at the small size, then blur and
+    // threshold
+    for (int y = 0; y < small_size.height; ++y) {
+        uint8_t* out = _grey.ptr<uint8_t>(y);
+        const uint8_t* p0 = _planes.ptr<uint8_t>(y);
+
+        if (channels == 1) {
+            for (int x = 0; x < small_size.width; ++x) {
+                out[x] = (uint8_t)(_weighted_lut[0][p0[x]] >> GREY_SHIFT);
+            }
+            continue;
+        }
+
+        const uint8_t* p1 = _planes.ptr<uint8_t>(small_size.height + y);
+        const uint8_t* p2 = _planes.ptr<uint8_t>(2 * small_size.height + y);
+        for (int x = 0; x < small_size.width; ++x) {
+            out[x] = (uint8_t)((_weighted_lut[0][p0[x]] + _weighted_lut[1][p1[x]]
+                                + _weighted_lut[2][p2[x]] + (1 << (GREY_SHIFT - 1))) >> GREY_SHIFT);
+        }
+    }
+
+    boxThreshold(_grey, mask, blur_size, threshold, isa, _column_sums);
+}
+
+ColourKey::ColourKey():
+    _tolerance(-1),
+    _lut((size_t)1 << (3 * BITS), 0)
+{
+}
+
+void ColourKey::setKey(const cv::Scalar& colour,
+                       int tolerance)
+{
+    if (colour == _colour && tolerance == _tolerance) {
+        return;
+    }
+
+    _colour = colour;
+    _tolerance = tolerance;
+
+    // per channel, which cells lie within the tolerance
+    const int CELLS = 1 << BITS;
+    const int CELL_SIZE = 256 / CELLS;
+    bool inside[3][1 << BITS];
+    for (int c = 0; c < 3; ++c) {
+        for (int cell = 0; cell < CELLS; ++cell) {
+            // doubled, so the centre of the cell stays an integer
+            int centre2 = 2 * cell * CELL_SIZE + CELL_SIZE - 1;
+            inside[c][cell] = std::abs(centre2 - 2 * (int)std::lround(colour[c])) <= 2 * tolerance;
+        }
+    }
+
+    uint8_t* lut = _lut.data();
+    for (int b = 0; b < CELLS; ++b) {
+        for (int g = 0; g < CELLS; ++g) {
+            for (int r = 0; r < CELLS; ++r) {
+                *lut++ = (uint8_t)(inside[0][b] && inside[1][g] && inside[2][r] ? 255 : 0);
+            }
+        }
+    }
+}
+
+void ColourKey::run(const cv::Mat& src,
+                    cv::Mat& mask) const
+{
+    CV_Assert(src.type() == CV_8UC3);
+    mask.create(src.size(), CV_8UC1);
+
+    const int SHIFT = 8 - BITS;
+    const uint8_t* lut = _lut.data();
+
+    int rows = src.rows;
+    int cols = src.cols;
+    if (src.isContinuous() && mask.isContinuous()) {
+        cols *= rows;
+        rows = 1;
+    }
+
+    // the table lookup is a gather, which SSE2 cannot do; the loop is left
+    // for the compiler to unroll
+    for (int y = 0; y < rows; ++y) {
+        const uint8_t* p = src.ptr<uint8_t>(y);
+        uint8_t* out = mask.ptr<uint8_t>(y);
+
+        for (int x = 0; x < cols; ++x, p += 3) {
+            out[x] = lut[((p[0] >> SHIFT) << (2 * BITS)) | ((p[1] >> SHIFT) << BITS) | (p[2] >> SHIFT)];
+        }
+    }
+}
+
+BackgroundModel::BackgroundModel():
+    _channels(0),
+    _step(0),
+    _initialized(false)
+{
+}
+
+void BackgroundModel::reset()
+{
+    _initialized = false;
+}
+
+void BackgroundModel::prepare(const cv::Size& frame_size,
+                              int channels,
+                              int step)
+{
+    if (frame_size == _frame_size && channels == _channels && step == _step) {
+        return;
+    }
+
+    _frame_size = frame_size;
+    _channels = channels;
+    _step = step;
+    _size = { std::max(1, frame_size.width / step), std::max(1, frame_size.height / step) };
+    _initialized = false;
+
+    _x_ofs.resize((size_t)_size.width);
+    for (int x = 0; x < _size.width; ++x) {
+        _x_ofs[x] = std::min(x * step + step / 2, frame_size.width - 1) * channels;
+    }
+
+    _model.assign((size_t)_size.area(), 0);
+    _samples.resize((size_t)_size.width);
+}
+
+void BackgroundModel::run(const cv::Mat& frame,
+                          int step,
+                          int learning_shift,
+                          int threshold,
+                          cv::Mat& mask,
+                          Isa isa)
+{
+    CV_Assert(frame.type() == CV_8UC1 || frame.type() == CV_8UC3);
+    CV_Assert(step >= 1 && learning_shift >= 0 && learning_shift < 16);
+
+    const int channels = frame.channels();
+    prepare(frame.size(), channels, step);
+    mask.create(_size, CV_8UC1);
+
+    for (int y = 0; y < _size.height; ++y) {
+        const uint8_t* src = frame.ptr<uint8_t>(std::min(y * step + step / 2, _frame_size.height - 1));
+        uint8_t* samples = _samples.data();
+
+        if (channels == 1) {
+            for (int x = 0; x < _size.width; ++x) {
+                samples[x] = src[_x_ofs[x]];
+            }
+        } else {
+            for (int x = 0; x < _size.width; ++x) {
+                const uint8_t* p = src + _x_ofs[x];
+                samples[x] = (uint8_t)((p[0] * GREY_WEIGHTS[0] + p[1] * GREY_WEIGHTS[1]
+                                        + p[2] * GREY_WEIGHTS[2] + (1 << (GREY_SHIFT - 1))) >> GREY_SHIFT);
+            }
+        }
+
+        uint16_t* model = &_model[(size_t)y * _size.width];
+        uint8_t* out = mask.ptr<uint8_t>(y);
+        if (!_initialized) {
+            for (int x = 0; x < _size.width; ++x) {
+                model[x] = (uint16_t)(samples[x] << 8);
+            }
+            std::memset(out, 0, (size_t)_size.width);
+            continue;
+        }
+
+        updateBackground(model, samples, out, _size.width, learning_shift, threshold, isa);
+    }
+
+    _initialized = true;
+}
+
+}
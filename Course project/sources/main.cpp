@@ -1,15 +1,25 @@
 #include <opencv2/opencv.hpp>
+#include <algorithm>
 #include <thread>
 #include <atomic>
+#include <chrono>
+#include <mutex>
 #include <utility>
 
 #include <csignal>
+#include <cstdio>
 #include <arkanoid.h>
 #include <timer.h>
 
 #include "motion_detector.h"
 #include "window.h"
 #include "message_queue.h"
+#include "frame_pool.h"
+#include "frame_source.h"
+#include "latency_tracer.h"
+#include "detector_pool.h"
+#include "calibration.h"
+#include "image_kernels.h"
 
 using namespace cv;
 
@@ -18,36 +28,71 @@ class CaptureThread: public std::thread
 public:
     std::atomic<bool> running;
 
-    CaptureThread():
+    CaptureThread(FrameSourceSettings settings,
+                  FramePool& frames):
         std::thread(),
-        running(true)
+        running(true),
+        _settings(std::move(settings)),
+        _frames(frames)
     {
         std::thread actual_thread(&CaptureThread::run, this);
         swap(actual_thread);
     }
 
     void run() {
-        cv::VideoCapture capture(0);
-        capture.set(CAP_PROP_FRAME_WIDTH, 1300);
-        capture.set(CAP_PROP_FRAME_HEIGHT, 720);
-        capture.set(CAP_PROP_FPS, 60);
+        std::unique_ptr<FrameSource> source = openFrameSource(_settings, { 1300, 720 }, 60);
 
-        if (capture.isOpened()) {
+        if (source->isOpened()) {
+            _frames.setGeometry(source->frameSize(), CV_8UC3);
         } else {
             running = false;
         }
 
+        // offline sources are replayed at their nominal rate unless free-running
+        std::chrono::steady_clock::duration frame_period(0);
+        if (!_settings.free_run && source->fps() > 0.0) {
+            frame_period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+                    std::chrono::duration<double>(1.0 / source->fps()));
+        }
+        std::chrono::steady_clock::time_point next_frame = std::chrono::steady_clock::now();
+        unsigned long long sequence = 0;
+
         while (running) {
-            Image frame;
-            if (!capture.read(frame)) {
+            Image frame = _frames.acquire();
+            if (!source->read(frame)) {
                 running = false;
             }
+            frame.stamp.sequence = ++sequence;
+            frame.stamp.capture_ns = Timer::monotonicNanos();
+
+            if (_settings.free_run) {
+                while (running && !images->push_wait(std::move(frame), std::chrono::milliseconds(100))) {
+                    // the detector is behind; hold on to the frame until it catches up
+                }
+            } else {
+                images->try_push(std::move(frame));
+            }
 
-            images->try_push(std::move(frame));
+            if (frame_period.count() > 0) {
+                next_frame += frame_period;
+                std::this_thread::sleep_until(next_frame);
+            }
         }
     }
 
-    std::shared_ptr<message_queue<Image>> images = std::make_shared<message_queue<Image>>(3);
+    std::shared_ptr<spsc_queue<Image>> images = std::make_shared<spsc_queue<Image>>(3);
+
+private:
+    FrameSourceSettings _settings;
+    FramePool& _frames;
+};
+
+// what the detector hands to the render loop; the debug view is only
+// composed from it if the frame actually gets displayed
+struct DisplayFrame
+{
+    Image background;
+    MotionDetector::Overlay overlay;
 };
 
 class DetectorThread: public std::thread
@@ -57,48 +102,331 @@ public:
 
     DetectorThread(size_t width,
                    size_t height,
-                   std::shared_ptr<message_queue<Image>>  capture):
+                   size_t workers,
+                   const MotionDetector::Settings& settings,
+                   std::shared_ptr<spsc_queue<Image>>  capture,
+                   LatencyTracer& tracer):
         running(true),
-        _capture(std::move(capture))
+        _settings(settings),
+        _capture(std::move(capture)),
+        _tracer(tracer),
+        _last_capture_ns(0),
+        _frame_interval_s(1.0 / 30.0)
     {
-        std::thread actual_thread(&DetectorThread::run, this, width, height);
+        std::thread actual_thread(&DetectorThread::run, this, width, height, workers);
         swap(actual_thread);
     }
 
   void run(size_t width,
-             size_t height)
+             size_t height,
+             size_t workers)
     {
+        if (workers > 0) {
+            runParallel(width, height, workers);
+            return;
+        }
+
         MotionDetector detector(width, height);
+        detector.settings = _settings;
         Image background;
 
         while (running) {
-            if (_capture->try_pop(background)) {
-                background.flip(Image::FlipAxis::Y);
-                detector.nextFrame(background);
+            if (!popFrame(background)) {
+                continue;
             }
 
-            images->try_push(detector.toImage(background));
-            marker_positions->try_push(detector.getMarkerPos());
+            detector.nextFrame(background);
+            publish(detector, background);
         }
     }
 
-    std::shared_ptr<message_queue<Image>> images = std::make_shared<message_queue<Image>>(3);
-    std::shared_ptr<message_queue<cv::Point2f>> marker_positions = std::make_shared<message_queue<cv::Point2f>>(3);
+    // detection fans out to `workers` threads; marker tracking stays in order
+    void runParallel(size_t width,
+                     size_t height,
+                     size_t workers)
+    {
+        MotionDetector detector(width, height);
+        detector.settings = _settings;
+
+        // where the sink's detector expects the marker; read by this thread
+        // for every frame it submits
+        std::mutex window_mutex;
+        const cv::Size frame_size((int)width, (int)height);
+        cv::Rect window(cv::Point(0, 0), frame_size);
+
+        DetectorPool pool(workers, width, height, detector.settings,
+                          [&](MotionDetector::Detection& detection) {
+                              Image background = detection.source;
+                              detector.integrate(detection);
+                              publish(detector, background);
+
+                              std::lock_guard<std::mutex> lock(window_mutex);
+                              window = detector.searchWindow(frame_size);
+                          });
+
+        Image background;
+
+        while (running) {
+            if (!popFrame(background)) {
+                continue;
+            }
+
+            cv::Rect search_window;
+            {
+                std::lock_guard<std::mutex> lock(window_mutex);
+                search_window = window;
+            }
+
+            while (running && !pool.submit(background, search_window, std::chrono::milliseconds(100))) {
+                // all workers busy; the capture queue absorbs the wait
+            }
+        }
+    }
+
+    std::shared_ptr<triple_buffer<DisplayFrame>> images = std::make_shared<triple_buffer<DisplayFrame>>();
+    std::shared_ptr<triple_buffer<MarkerSample>> marker_positions = std::make_shared<triple_buffer<MarkerSample>>();
 
 private:
-    std::shared_ptr<message_queue<Image>> _capture;
+    bool popFrame(Image& background) {
+        if (!_capture->pop_wait(background, std::chrono::milliseconds(100))) {
+            return false;
+        }
+
+        background.stamp.dequeued_ns = Timer::monotonicNanos();
+        _tracer.record(LatencyTracer::CAPTURE_QUEUE, background.stamp.capture_ns,
+                       background.stamp.dequeued_ns);
+
+        background.flip(Image::FlipAxis::Y);
+        return true;
+    }
+
+    void publish(const MotionDetector& detector,
+                 const Image& background) {
+        DisplayFrame frame;
+        frame.background = background;
+        detector.overlay(frame.overlay);
+
+        FrameStamp& stamp = frame.background.stamp;
+        stamp.processed_ns = Timer::monotonicNanos();
+        _tracer.record(LatencyTracer::DETECT, stamp.dequeued_ns, stamp.processed_ns);
+
+        // the filter's velocity is per processed frame; frames come at the
+        // capture rate, which only the stamps know
+        if (_last_capture_ns != 0 && stamp.capture_ns > _last_capture_ns) {
+            double interval_s = (stamp.capture_ns - _last_capture_ns) / 1e9;
+            _frame_interval_s += (interval_s - _frame_interval_s) * 0.1;
+        }
+        _last_capture_ns = stamp.capture_ns;
+
+        float per_second = (float)(1.0 / _frame_interval_s);
+        MarkerTracker::Markers markers = detector.getMarkerPositions();
+        for (TrackedMarker& marker: markers) {
+            marker.velocity *= per_second;
+        }
+
+        marker_positions->push({ detector.getMarkerPos(), detector.getMarkerVelocity() * per_second,
+                                 stamp, markers });
+        images->push(std::move(frame));
+    }
+
+    MotionDetector::Settings _settings;
+    std::shared_ptr<spsc_queue<Image>> _capture;
+    LatencyTracer& _tracer;
+
+    long long _last_capture_ns;
+    double _frame_interval_s;
+};
+
+struct PipelineSettings
+{
+    FrameSourceSettings source;
+
+    // 0 runs detection on the detector thread itself
+    size_t detector_workers = 0;
+
+    MotionDetector::Settings detector;
+
+    // how far past the last marker sample the paddle may be extrapolated
+    double max_paddle_prediction_s = 0.1;
+
+    // one paddle per tracked marker above 1
+    size_t players = 1;
+
+    // calibrate at startup and save to calibration_path; otherwise the
+    // file is loaded if it exists and replaces the defaults of the settings
+    // it holds, which the command line still overrides
+    bool calibrate = false;
+    std::string calibration_path = "calibration.yml";
 };
 
-int main() {
+// the command line over `defaults`
+static PipelineSettings parsePipelineSettings(int argc,
+                                              char** argv,
+                                              const PipelineSettings& defaults = PipelineSettings())
+{
+    PipelineSettings settings = defaults;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+
+        if (arg == "--camera" && i + 1 < argc) {
+            settings.source.kind = FrameSourceSettings::Kind::Camera;
+            settings.source.camera_index = std::atoi(argv[++i]);
+        } else if (arg == "--video" && i + 1 < argc) {
+            settings.source.kind = FrameSourceSettings::Kind::VideoFile;
+            settings.source.path = argv[++i];
+        } else if (arg == "--synthetic") {
+            settings.source.kind = FrameSourceSettings::Kind::Synthetic;
+        } else if (arg == "--no-loop") {
+            settings.source.loop = false;
+        } else if (arg == "--free-run") {
+            settings.source.free_run = true;
+        } else if (arg == "--detector-workers" && i + 1 < argc) {
+            settings.detector_workers = (size_t)std::atoi(argv[++i]);
+        } else if (arg == "--pyramid-level" && i + 1 < argc) {
+            settings.detector.pyramid_level = std::atoi(argv[++i]);
+        } else if (arg == "--players" && i + 1 < argc) {
+            settings.players = std::max<size_t>(1, std::min<size_t>(std::atoi(argv[++i]),
+                                                                    MarkerTracker::MAX_TRACKS));
+            settings.detector.max_markers = settings.players;
+        } else if (arg == "--max-prediction-ms" && i + 1 < argc) {
+            settings.max_paddle_prediction_s = std::atof(argv[++i]) / 1e3;
+        } else if (arg == "--one-euro") {
+            settings.detector.marker_filter = PositionFilterKind::OneEuro;
+        } else if (arg == "--calibrate") {
+            settings.calibrate = true;
+        } else if (arg == "--calibration" && i + 1 < argc) {
+            settings.calibration_path = argv[++i];
+        } else if (arg == "--marker-colour" && i + 1 < argc) {
+            int b, g, r;
+            if (std::sscanf(argv[++i], "%d,%d,%d", &b, &g, &r) != 3) {
+                std::cerr << "--marker-colour takes B,G,R\n";
+                std::exit(1);
+            }
+            settings.detector.marker_colour = cv::Scalar(b, g, r);
+        } else if (arg == "--colour-tolerance" && i + 1 < argc) {
+            settings.detector.marker_colour_tolerance = std::atoi(argv[++i]);
+        } else if (arg == "--background-model") {
+            settings.detector.mode = DetectionMode::BackgroundModel;
+        } else if (arg == "--optical-flow") {
+            settings.detector.mode = DetectionMode::OpticalFlow;
+        } else if (arg == "--track-window") {
+            settings.detector.track_window = true;
+        } else if (arg == "--skip-static-tiles") {
+            settings.detector.skip_static_tiles = true;
+        } else if (arg == "--connected-components") {
+            settings.detector.connected_components = true;
+        } else {
+            std::cerr << "usage: " << argv[0]
+                      << " [--camera N | --video PATH | --synthetic] [--no-loop] [--free-run]"
+                         " [--detector-workers N] [--pyramid-level N] [--connected-components]"
+                         " [--skip-static-tiles] [--track-window] [--optical-flow | --background-model] [--one-euro]"
+                         " [--max-prediction-ms MS] [--players N]"
+                         " [--marker-colour B,G,R] [--colour-tolerance N]"
+                         " [--calibrate] [--calibration PATH]\n";
+            std::exit(1);
+        }
+    }
+
+    // the pool's workers only run detectMotion(); the other modes keep
+    // state from frame to frame and need nextFrame()
+    if (settings.detector_workers > 0 && settings.detector.mode != DetectionMode::FrameDifference) {
+        std::cerr << "--optical-flow and --background-model cannot be used with --detector-workers\n";
+        std::exit(1);
+    }
+
+    return settings;
+}
+
+// walks the player through the Calibrator phases on live frames and stores
+// the result in `detector`; false if cancelled with Esc or the source ended
+static bool runCalibration(Window& window,
+                           CaptureThread& capture,
+                           size_t width,
+                           size_t height,
+                           MotionDetector::Settings& detector)
+{
+    Calibrator calibrator(width, height, detector);
+    const cv::Scalar COLOR(0, 255, 0);
+
+    Image frame;
+    while (calibrator.phase() != Calibrator::Phase::Done) {
+        if (!capture.running) {
+            return false;
+        }
+
+        if (capture.images->pop_wait(frame, std::chrono::milliseconds(100))) {
+            frame.flip(Image::FlipAxis::Y);
+            calibrator.addFrame(frame);
+
+            if (calibrator.phase() == Calibrator::Phase::Marker) {
+                cv::rectangle(frame, Calibrator::markerBox(frame.size()), COLOR, 2);
+            }
+            cv::putText(frame, calibrator.instructions(), { 20, 40 },
+                        cv::FONT_HERSHEY_SIMPLEX, 1.0, COLOR, 2);
+            cv::rectangle(frame, { 20, 60 },
+                          { 20 + (int)(calibrator.progress() * (frame.cols - 40)), 70 },
+                          COLOR, cv::FILLED);
+            window.showImage(frame);
+        }
+
+        if ((char)waitKey(1) == 27) {
+            return false;
+        }
+    }
+
+    calibrator.result().applyTo(detector);
+    return true;
+}
+
+int main(int argc, char** argv) {
+
+    PipelineSettings settings = parsePipelineSettings(argc, argv);
+
+    // the file only knows where it is once the command line is parsed; it
+    // becomes the defaults and the command line is parsed again over it
+    if (!settings.calibrate) {
+        PipelineSettings defaults;
+        Calibration calibration = Calibration::from(defaults.detector);
+        if (calibration.load(settings.calibration_path)) {
+            calibration.applyTo(defaults.detector);
+            std::cout << "Calibration loaded from " << settings.calibration_path << "\n";
+            settings = parsePipelineSettings(argc, argv, defaults);
+        }
+    }
+
+    // probes the CPU once, before any thread runs a kernel
+    std::cout << "Image kernels: " << kernels::isaName(kernels::bestIsa()) << "\n";
 
     Window window("arkanoid");
 
     const size_t WIDTH = 1300;
     const size_t HEIGHT = 720;
 
-    CaptureThread capture;
-    DetectorThread detector(WIDTH, HEIGHT, capture.images);
-    Game arkanoid(WIDTH, HEIGHT);
+    // declared before the threads: every frame they hand around must be
+    // returned before the pools go away
+    FramePool capture_frames({ (int)WIDTH, (int)HEIGHT }, CV_8UC3);
+    LatencyTracer tracer;
+
+    CaptureThread capture(settings.source, capture_frames);
+
+    if (settings.calibrate) {
+        if (runCalibration(window, capture, WIDTH, HEIGHT, settings.detector)) {
+            Calibration calibration = Calibration::from(settings.detector);
+            if (calibration.save(settings.calibration_path)) {
+                std::cout << "Calibration saved to " << settings.calibration_path << "\n";
+            } else {
+                std::cerr << "cannot write " << settings.calibration_path << "\n";
+            }
+        } else {
+            std::cerr << "calibration cancelled\n";
+        }
+    }
+
+    DetectorThread detector(WIDTH, HEIGHT, settings.detector_workers, settings.detector,
+                            capture.images, tracer);
+    Game arkanoid(WIDTH, HEIGHT, settings.players);
+    arkanoid.setMaxPrediction(settings.max_paddle_prediction_s);
 
     try {
         char key = 0;
@@ -107,14 +435,38 @@ int main() {
         double dt = -3.0;
         const double UPDATE_STEP_S = 1.0 / 60.0;
 
-        Image background(WIDTH, HEIGHT, CV_8UC3);
+        // the last camera frame with its overlay, kept clean; every loop
+        // draws the game over a copy of it in `screen`
+        Image background((int)HEIGHT, (int)WIDTH, CV_8UC3, cv::Scalar::all(0));
+        Image screen;
+        DisplayFrame shown;
+
+        long long loop_start_ns = Timer::monotonicNanos();
+
+        // from placing the paddle to handing the frame to the window
+        long long present_delay_ns = 0;
 
         while (key != 27) {
-            cv::Point2f marker_pos;
-            if (detector.marker_positions->try_pop(marker_pos)) {
-                arkanoid.setPaddlePos((size_t)marker_pos.x);
+            MarkerSample marker;
+            if (detector.marker_positions->try_pop(marker)) {
+                if (arkanoid.paddles() == 1) {
+                    arkanoid.setPaddleTarget(marker.position.x, marker.velocity.x, marker.stamp.capture_ns);
+                } else {
+                    for (size_t i = 0; i < arkanoid.paddles(); ++i) {
+                        if (marker.markers[i].alive) {
+                            arkanoid.setPaddleTarget(i, marker.markers[i].position.x,
+                                                     marker.markers[i].velocity.x,
+                                                     marker.stamp.capture_ns);
+                        }
+                    }
+                }
+                tracer.record(LatencyTracer::MARKER, marker.stamp.capture_ns, Timer::monotonicNanos());
             }
 
+            long long placed_ns = Timer::monotonicNanos();
+            long long horizon_ns = arkanoid.extrapolatePaddle(placed_ns + present_delay_ns);
+            tracer.record(LatencyTracer::PREDICTION, 0, horizon_ns);
+
             dt += timer.getElapsedSeconds();
             timer.reset();
             while (dt > UPDATE_STEP_S) {
@@ -126,11 +478,34 @@ int main() {
                 arkanoid.reset();
             }
 
-            detector.images->try_pop(background);
-            arkanoid.drawOnto(background);
-            window.showImage(background);
+            bool new_frame = detector.images->try_pop(shown);
+            long long popped_ns = Timer::monotonicNanos();
+            if (new_frame) {
+                shown.overlay.render(shown.background, background);
+            }
+
+            background.copyTo(screen);
+            arkanoid.drawOnto(screen);
+            window.showImage(screen);
+            present_delay_ns += (Timer::monotonicNanos() - placed_ns - present_delay_ns) / 8;
+
+            if (new_frame) {
+                long long shown_ns = Timer::monotonicNanos();
+                const FrameStamp& stamp = shown.background.stamp;
+                tracer.record(LatencyTracer::DISPLAY_QUEUE, stamp.processed_ns, popped_ns);
+                tracer.record(LatencyTracer::PRESENT, popped_ns, shown_ns);
+                tracer.record(LatencyTracer::END_TO_END, stamp.capture_ns, shown_ns);
+                tracer.frameDisplayed(stamp);
+            }
 
             key = (char) waitKey(20);
+            if (key == 'l') {
+                tracer.dump(std::cout);
+            }
+
+            long long loop_end_ns = Timer::monotonicNanos();
+            tracer.record(LatencyTracer::RENDER_LOOP, loop_start_ns, loop_end_ns);
+            loop_start_ns = loop_end_ns;
         }
     } catch (...) {
 
@@ -141,5 +516,19 @@ int main() {
     capture.join();
     detector.join();
 
+    std::cout << "Overwritten before display: "
+              << detector.images->overwritten() << " frames, "
+              << detector.marker_positions->overwritten() << " marker positions\n";
+
+    tracer.dump(std::cout);
+
+    std::cout << "Paddle prediction: " << arkanoid.meanPredictionError() << " px mean residual error, "
+              << arkanoid.meanHoldError() << " px without prediction\n";
+
+    FramePool::Stats stats = capture_frames.stats();
+    std::cout << "Frame pool: " << stats.hits << " hits, "
+              << stats.misses << " misses, "
+              << stats.peak_in_flight << " peak in flight\n";
+
     return 0;
 };
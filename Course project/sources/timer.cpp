@@ -35,3 +35,13 @@ unsigned long Timer::getElapsedNanos() {
     assert(time_diff_ns >= 0);
     return (unsigned long)time_diff_ns;
 }
+
+long long Timer::monotonicNanos() {
+    struct timespec now{};
+
+    if (clock_gettime(CLOCK_MONOTONIC, &now)) {
+        throw std::runtime_error("cannot get time");
+    }
+
+    return (long long)now.tv_sec * std::nano::den + now.tv_nsec;
+}